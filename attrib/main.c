@@ -71,7 +71,7 @@ static int attribute(struct exfat* ef, struct exfat_node* node,
 			int ret;
 
 			node->attrib = attrib;
-			node->is_dirty = true;
+			exfat_mark_dirty(ef, node);
 
 			ret = exfat_flush_node(ef, node);
 			if (ret != 0)
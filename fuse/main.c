@@ -103,8 +103,22 @@ static int fuse_exfat_truncate(const char* path, off_t size
 	return rc;
 }
 
+static int fill_dir(void* buffer, fuse_fill_dir_t filler, const char* name,
+		const struct stat* stbuf, off_t next)
+{
+#if FUSE_USE_VERSION < 30
+	return filler(buffer, name, stbuf, next);
+#else
+	return filler(buffer, name, stbuf, next, 0);
+#endif
+}
+
+/*
+ * Listing can be resumed: positions 1 and 2 follow "." and "..", the rest
+ * are directory offsets (shifted by 2) to continue from.
+ */
 static int fuse_exfat_readdir(const char* path, void* buffer,
-		fuse_fill_dir_t filler, UNUSED off_t offset,
+		fuse_fill_dir_t filler, off_t offset,
 		UNUSED struct fuse_file_info* fi
 #if FUSE_USE_VERSION >= 30
 		, UNUSED enum fuse_readdir_flags flags
@@ -112,13 +126,12 @@ static int fuse_exfat_readdir(const char* path, void* buffer,
 		)
 {
 	struct exfat_node* parent;
-	struct exfat_node* node;
-	struct exfat_iterator it;
+	struct exfat_dir_stream stream;
+	struct exfat_dirent dirent;
 	int rc;
-	char name[EXFAT_UTF8_NAME_BUFFER_MAX];
 	struct stat stbuf;
 
-	exfat_debug("[%s] %s", __func__, path);
+	exfat_debug("[%s] %s at %"PRId64, __func__, path, (int64_t) offset);
 
 	rc = exfat_lookup(&ef, &parent, path);
 	if (rc != 0)
@@ -130,38 +143,35 @@ static int fuse_exfat_readdir(const char* path, void* buffer,
 		return -ENOTDIR;
 	}
 
-#if FUSE_USE_VERSION < 30
-	filler(buffer, ".", NULL, 0);
-	filler(buffer, "..", NULL, 0);
-#else
-	filler(buffer, ".", NULL, 0, 0);
-	filler(buffer, "..", NULL, 0, 0);
-#endif
+	if ((offset < 1 && fill_dir(buffer, filler, ".", NULL, 1) != 0) ||
+			(offset < 2 && fill_dir(buffer, filler, "..", NULL, 2) != 0))
+	{
+		exfat_put_node(&ef, parent);
+		return 0;
+	}
 
-	rc = exfat_opendir(&ef, parent, &it);
+	/* do not cache the directory just to list it */
+	rc = exfat_open_stream(&ef, parent, &stream);
 	if (rc != 0)
 	{
 		exfat_put_node(&ef, parent);
 		exfat_error("failed to open directory '%s'", path);
 		return rc;
 	}
-	while ((node = exfat_readdir(&it)))
+	if (offset > 2)
+		rc = exfat_seek_stream(&ef, &stream, offset - 2);
+	while (rc == 0 && (rc = exfat_read_stream(&ef, &stream, &dirent)) == 0)
 	{
-		exfat_get_name(node, name);
-		exfat_debug("[%s] %s: %s, %"PRId64" bytes, cluster 0x%x", __func__,
-				name, node->is_contiguous ? "contiguous" : "fragmented",
-				node->size, node->start_cluster);
-		exfat_stat(&ef, node, &stbuf);
-#if FUSE_USE_VERSION < 30
-		filler(buffer, name, &stbuf, 0);
-#else
-		filler(buffer, name, &stbuf, 0, 0);
-#endif
-		exfat_put_node(&ef, node);
+		exfat_debug("[%s] %s: %"PRId64" bytes", __func__, dirent.name,
+				dirent.size);
+		exfat_stat_dirent(&ef, &dirent, &stbuf);
+		if (fill_dir(buffer, filler, dirent.name, &stbuf,
+				stream.offset + 2) != 0)
+			break; /* the buffer is full */
 	}
-	exfat_closedir(&ef, &it);
+	exfat_close_stream(&ef, &stream);
 	exfat_put_node(&ef, parent);
-	return 0;
+	return rc == -ENOENT ? 0 : rc;
 }
 
 static int fuse_exfat_open(const char* path, struct fuse_file_info* fi)
@@ -203,10 +213,7 @@ static int fuse_exfat_create(const char* path, UNUSED mode_t mode,
 
 	exfat_debug("[%s] %s 0%ho", __func__, path, mode);
 
-	rc = exfat_mknod(&ef, path);
-	if (rc != 0)
-		return rc;
-	rc = exfat_lookup(&ef, &node, path);
+	rc = exfat_create(&ef, path, EXFAT_ATTRIB_ARCH, &node);
 	if (rc != 0)
 		return rc;
 	set_node(fi, node);
@@ -343,7 +350,7 @@ static int fuse_exfat_utimens(const char* path, const struct timespec tv[2]
 	if (rc != 0)
 		return rc;
 
-	exfat_utimes(node, tv);
+	exfat_utimes(&ef, node, tv);
 	rc = exfat_flush_node(&ef, node);
 	exfat_put_node(&ef, node);
 	return rc;
@@ -418,6 +425,9 @@ static void* fuse_exfat_init(
 
 	/* mark super block as dirty; failure isn't a big deal */
 	exfat_soil_super_block(&ef);
+	/* threads do not survive daemonizing, so start the worker here and not
+	   in exfat_mount(); the driver works without it, only slower */
+	exfat_start_worker(&ef);
 
 	return NULL;
 }
@@ -111,62 +111,343 @@ cluster_t exfat_advance_cluster(const struct exfat* ef,
 	return node->fptr_cluster;
 }
 
-static cluster_t find_bit_and_set(bitmap_t* bitmap, size_t start, size_t end)
+/*
+ * Clusters bitmap is kept in memory as a table of blocks, CMAP_BLOCK_BITS
+ * bits each. Blocks where all clusters are free or all are used point to
+ * shared zero_block and full_block respectively, so the long runs typical
+ * for large volumes take no memory. A block gets its own copy when it's
+ * modified and shares again when it becomes uniform.
+ */
+#define CMAP_BLOCK_BITS (4096 * 8)
+#define CMAP_BLOCK_SIZE (CMAP_BLOCK_BITS / 8)
+#define CMAP_BLOCK_WORDS (CMAP_BLOCK_SIZE / sizeof(bitmap_t))
+#define CMAP_READ_BLOCKS 64
+
+static uint32_t count_bits(bitmap_t word)
+{
+	uint32_t count = 0;
+
+	for (; word != 0; word &= word - 1)
+		count++;
+	return count;
+}
+
+/*
+ * Number of valid bits in a block. Only the last one can be partial.
+ */
+static uint32_t block_bits(const struct exfat* ef, uint32_t b)
+{
+	return MIN(CMAP_BLOCK_BITS, ef->cmap.size - b * CMAP_BLOCK_BITS);
+}
+
+static bool is_shared(const struct exfat* ef, const bitmap_t* block)
+{
+	return block == ef->cmap.zero_block || block == ef->cmap.full_block;
+}
+
+static bool cmap_get(const struct exfat* ef, uint32_t index)
+{
+	return BMAP_GET(ef->cmap.blocks[index / CMAP_BLOCK_BITS],
+			index % CMAP_BLOCK_BITS) != 0;
+}
+
+bool exfat_is_cluster_allocated(const struct exfat* ef, cluster_t cluster)
+{
+	return cmap_get(ef, cluster - EXFAT_FIRST_DATA_CLUSTER);
+}
+
+/*
+ * Get a private copy of a block which can be modified.
+ */
+static bitmap_t* unshare_block(struct exfat* ef, uint32_t b)
 {
-	const size_t start_index = start / sizeof(bitmap_t) / 8;
-	const size_t end_index = DIV_ROUND_UP(end, sizeof(bitmap_t) * 8);
-	size_t i;
-	size_t start_bitindex;
-	size_t end_bitindex;
-	size_t c;
+	bitmap_t* block = ef->cmap.blocks[b];
 
-	for (i = start_index; i < end_index; i++)
+	if (!is_shared(ef, block))
+		return block;
+	block = malloc(CMAP_BLOCK_SIZE);
+	if (block == NULL)
 	{
-		if (bitmap[i] == (bitmap_t) ~((bitmap_t) 0))
+		exfat_error("failed to allocate clusters bitmap block");
+		return NULL;
+	}
+	memcpy(block, ef->cmap.blocks[b], CMAP_BLOCK_SIZE);
+	ef->cmap.blocks[b] = block;
+	return block;
+}
+
+/*
+ * Called after a block has been modified: mark it for writing and return
+ * its memory if it became uniform.
+ */
+static void update_block(struct exfat* ef, uint32_t b)
+{
+	bitmap_t* block = ef->cmap.blocks[b];
+
+	BMAP_SET(ef->cmap.dirty_blocks, b);
+	ef->cmap.dirty = true;
+	if (is_shared(ef, block) || block_bits(ef, b) != CMAP_BLOCK_BITS)
+		return;
+	if (ef->cmap.free_counts[b] == CMAP_BLOCK_BITS)
+		ef->cmap.blocks[b] = ef->cmap.zero_block;
+	else if (ef->cmap.free_counts[b] == 0)
+		ef->cmap.blocks[b] = ef->cmap.full_block;
+	else
+		return;
+	free(block);
+}
+
+/*
+ * Find the first free cluster in [start, end) range of bitmap indices.
+ * Returns end if there is none.
+ */
+static uint32_t find_free_bit(const struct exfat* ef, uint32_t start,
+		uint32_t end)
+{
+	const size_t bits = sizeof(bitmap_t) * 8;
+	uint32_t b;
+
+	for (b = start / CMAP_BLOCK_BITS; b < DIV_ROUND_UP(end, CMAP_BLOCK_BITS);
+			b++)
+	{
+		const uint32_t first = b * CMAP_BLOCK_BITS;
+		const uint32_t from = MAX(first, start) - first;
+		const uint32_t to = MIN(first + block_bits(ef, b), end) - first;
+		const bitmap_t* block = ef->cmap.blocks[b];
+		uint32_t c;
+
+		if (ef->cmap.free_counts[b] == 0)
 			continue;
-		start_bitindex = MAX(i * sizeof(bitmap_t) * 8, start);
-		end_bitindex = MIN((i + 1) * sizeof(bitmap_t) * 8, end);
-		for (c = start_bitindex; c < end_bitindex; c++)
-			if (BMAP_GET(bitmap, c) == 0)
+		for (c = from; c < to; c++)
+		{
+			if (c % bits == 0 && c + bits <= to &&
+					block[BMAP_BLOCK(c)] == (bitmap_t) ~((bitmap_t) 0))
 			{
-				BMAP_SET(bitmap, c);
-				return c + EXFAT_FIRST_DATA_CLUSTER;
+				c += bits - 1;
+				continue;
 			}
+			if (BMAP_GET(block, c) == 0 && !exfat_zero_pool_contains(ef,
+					first + c + EXFAT_FIRST_DATA_CLUSTER))
+				return first + c;
+		}
+	}
+	return end;
+}
+
+/*
+ * Check that the cluster is free and is not held by the zeroed pool.
+ */
+static bool is_free(const struct exfat* ef, cluster_t cluster)
+{
+	return !cmap_get(ef, cluster - EXFAT_FIRST_DATA_CLUSTER) &&
+			!exfat_zero_pool_contains(ef, cluster);
+}
+
+/*
+ * Returned instead of a cluster when the bitmap cannot be changed for lack
+ * of memory, so that this is not reported as running out of space.
+ */
+#define CLUSTER_NOMEM EXFAT_CLUSTER_BAD
+
+/*
+ * Mark a free cluster as used. Returns the cluster number or
+ * CLUSTER_NOMEM.
+ */
+static cluster_t set_bit(struct exfat* ef, uint32_t index)
+{
+	const uint32_t b = index / CMAP_BLOCK_BITS;
+	bitmap_t* block;
+
+	block = unshare_block(ef, b);
+	if (block == NULL)
+		return CLUSTER_NOMEM;
+	BMAP_SET(block, index % CMAP_BLOCK_BITS);
+	ef->cmap.free_counts[b]--;
+	update_block(ef, b);
+	return index + EXFAT_FIRST_DATA_CLUSTER;
+}
+
+static cluster_t find_bit_and_set(struct exfat* ef, uint32_t start,
+		uint32_t end)
+{
+	const uint32_t index = find_free_bit(ef, start, end);
+
+	if (index == end)
+		return EXFAT_CLUSTER_END;
+	return set_bit(ef, index);
+}
+
+/*
+ * Clear bits [start, end) which must belong to a single block.
+ */
+static int clear_block_bits(struct exfat* ef, uint32_t b, uint32_t start,
+		uint32_t end)
+{
+	const size_t bits = sizeof(bitmap_t) * 8;
+	bitmap_t* block;
+	uint32_t cleared = 0;
+	uint32_t i = start;
+
+	if (ef->cmap.free_counts[b] == block_bits(ef, b))
+		return 0; /* nothing to clear */
+	if (start == 0 && end == CMAP_BLOCK_BITS)
+	{
+		if (!is_shared(ef, ef->cmap.blocks[b]))
+			free(ef->cmap.blocks[b]);
+		ef->cmap.blocks[b] = ef->cmap.zero_block;
+		ef->cmap.free_counts[b] = CMAP_BLOCK_BITS;
+		update_block(ef, b);
+		return 0;
 	}
-	return EXFAT_CLUSTER_END;
+
+	block = unshare_block(ef, b);
+	if (block == NULL)
+		return -ENOMEM;
+	/* head: up to the first word boundary */
+	for (; i < end && i % bits != 0; i++)
+		if (BMAP_GET(block, i))
+		{
+			BMAP_CLR(block, i);
+			cleared++;
+		}
+	/* body: whole words at once */
+	for (; i + bits <= end; i += bits)
+	{
+		cleared += count_bits(block[BMAP_BLOCK(i)]);
+		block[BMAP_BLOCK(i)] = 0;
+	}
+	/* tail */
+	for (; i < end; i++)
+		if (BMAP_GET(block, i))
+		{
+			BMAP_CLR(block, i);
+			cleared++;
+		}
+	ef->cmap.free_counts[b] += cleared;
+	update_block(ef, b);
+	return 0;
 }
 
-static int flush_nodes(struct exfat* ef, struct exfat_node* node)
+int exfat_load_cmap(struct exfat* ef)
 {
-	struct exfat_node* p;
+	const uint32_t block_count = DIV_ROUND_UP(ef->cmap.size, CMAP_BLOCK_BITS);
+	const size_t total_size = BMAP_SIZE(ef->cmap.size);
+	bitmap_t* buffer;
+	uint32_t b;
+	uint32_t i;
 
-	for (p = node->child; p != NULL; p = p->next)
+	ef->cmap.blocks = calloc(block_count, sizeof(bitmap_t*));
+	ef->cmap.free_counts = calloc(block_count, sizeof(uint16_t));
+	ef->cmap.dirty_blocks = calloc(BMAP_SIZE(block_count), 1);
+	ef->cmap.zero_block = calloc(1, CMAP_BLOCK_SIZE);
+	ef->cmap.full_block = malloc(CMAP_BLOCK_SIZE);
+	buffer = malloc(CMAP_BLOCK_SIZE * CMAP_READ_BLOCKS);
+	if (ef->cmap.blocks == NULL || ef->cmap.free_counts == NULL ||
+			ef->cmap.dirty_blocks == NULL || ef->cmap.zero_block == NULL ||
+			ef->cmap.full_block == NULL || buffer == NULL)
 	{
-		int rc = flush_nodes(ef, p);
-		if (rc != 0)
-			return rc;
+		free(buffer);
+		exfat_free_cmap(ef);
+		exfat_error("failed to allocate clusters bitmap (%u blocks)",
+				block_count);
+		return -ENOMEM;
 	}
-	return exfat_flush_node(ef, node);
+	memset(ef->cmap.full_block, 0xff, CMAP_BLOCK_SIZE);
+	ef->cmap.block_count = block_count;
+	for (b = 0; b < block_count; b++)
+		ef->cmap.blocks[b] = ef->cmap.zero_block;
+
+	for (b = 0; b < block_count; b++)
+	{
+		const size_t offset = (size_t) b * CMAP_BLOCK_SIZE;
+		const size_t size = MIN(CMAP_BLOCK_SIZE, total_size - offset);
+		const bitmap_t* source;
+		uint32_t used = 0;
+
+		if (b % CMAP_READ_BLOCKS == 0 && exfat_pread(ef->dev, buffer,
+				MIN(CMAP_BLOCK_SIZE * CMAP_READ_BLOCKS, total_size - offset),
+				exfat_c2o(ef, ef->cmap.start_cluster) + offset) < 0)
+		{
+			free(buffer);
+			exfat_free_cmap(ef);
+			exfat_error("failed to read clusters bitmap "
+					"(%zu bytes starting at cluster %#x)", total_size,
+					ef->cmap.start_cluster);
+			return -EIO;
+		}
+		source = buffer + (b % CMAP_READ_BLOCKS) * CMAP_BLOCK_WORDS;
+		for (i = 0; i < block_bits(ef, b); i++)
+			if (BMAP_GET(source, i))
+				used++;
+		ef->cmap.free_counts[b] = block_bits(ef, b) - used;
+		if (block_bits(ef, b) == CMAP_BLOCK_BITS && used == 0)
+			continue;
+		if (block_bits(ef, b) == CMAP_BLOCK_BITS && used == CMAP_BLOCK_BITS)
+		{
+			ef->cmap.blocks[b] = ef->cmap.full_block;
+			continue;
+		}
+		ef->cmap.blocks[b] = calloc(1, CMAP_BLOCK_SIZE);
+		if (ef->cmap.blocks[b] == NULL)
+		{
+			ef->cmap.blocks[b] = ef->cmap.zero_block;
+			free(buffer);
+			exfat_free_cmap(ef);
+			exfat_error("failed to allocate clusters bitmap block");
+			return -ENOMEM;
+		}
+		memcpy(ef->cmap.blocks[b], source, size);
+	}
+	free(buffer);
+	return 0;
 }
 
-int exfat_flush_nodes(struct exfat* ef)
+void exfat_free_cmap(struct exfat* ef)
 {
-	return flush_nodes(ef, ef->root);
+	uint32_t b;
+
+	for (b = 0; b < ef->cmap.block_count; b++)
+		if (!is_shared(ef, ef->cmap.blocks[b]))
+			free(ef->cmap.blocks[b]);
+	free(ef->cmap.blocks);
+	ef->cmap.blocks = NULL;
+	free(ef->cmap.free_counts);
+	ef->cmap.free_counts = NULL;
+	free(ef->cmap.dirty_blocks);
+	ef->cmap.dirty_blocks = NULL;
+	free(ef->cmap.zero_block);
+	ef->cmap.zero_block = NULL;
+	free(ef->cmap.full_block);
+	ef->cmap.full_block = NULL;
+	ef->cmap.block_count = 0;
 }
 
 int exfat_flush(struct exfat* ef)
 {
-	if (ef->cmap.dirty)
+	const size_t total_size = BMAP_SIZE(ef->cmap.size);
+	uint32_t b;
+
+	exfat_reclaim_clusters(ef, false);
+	if (!ef->cmap.dirty)
+		return 0;
+
+	/* write only modified blocks */
+	for (b = 0; b < ef->cmap.block_count; b++)
 	{
-		if (exfat_pwrite(ef->dev, ef->cmap.chunk,
-				BMAP_SIZE(ef->cmap.chunk_size),
-				exfat_c2o(ef, ef->cmap.start_cluster)) < 0)
+		const size_t offset = (size_t) b * CMAP_BLOCK_SIZE;
+
+		if (BMAP_GET(ef->cmap.dirty_blocks, b) == 0)
+			continue;
+		if (exfat_pwrite(ef->dev, ef->cmap.blocks[b],
+				MIN(CMAP_BLOCK_SIZE, total_size - offset),
+				exfat_c2o(ef, ef->cmap.start_cluster) + offset) < 0)
 		{
 			exfat_error("failed to write clusters bitmap");
 			return -EIO;
 		}
-		ef->cmap.dirty = false;
+		BMAP_CLR(ef->cmap.dirty_blocks, b);
 	}
+	ef->cmap.dirty = false;
 
 	return 0;
 }
@@ -196,30 +477,137 @@ static cluster_t allocate_cluster(struct exfat* ef, cluster_t hint)
 	cluster_t cluster;
 
 	hint -= EXFAT_FIRST_DATA_CLUSTER;
-	if (hint >= ef->cmap.chunk_size)
+	if (hint >= ef->cmap.size)
 		hint = 0;
 
-	cluster = find_bit_and_set(ef->cmap.chunk, hint, ef->cmap.chunk_size);
+	cluster = find_bit_and_set(ef, hint, ef->cmap.size);
 	if (cluster == EXFAT_CLUSTER_END)
-		cluster = find_bit_and_set(ef->cmap.chunk, 0, hint);
+		cluster = find_bit_and_set(ef, 0, hint);
+	/* removed files can still be freed in background */
+	if (cluster == EXFAT_CLUSTER_END && exfat_reclaim_clusters(ef, true) != 0)
+		cluster = find_bit_and_set(ef, 0, ef->cmap.size);
+	if (cluster == EXFAT_CLUSTER_END)
+	{
+		/* the zeroed pool holds the last free clusters */
+		cluster = exfat_zero_pool_take(ef, EXFAT_CLUSTER_END, true);
+		if (cluster != EXFAT_CLUSTER_END)
+			return set_bit(ef, cluster - EXFAT_FIRST_DATA_CLUSTER);
+	}
 	if (cluster == EXFAT_CLUSTER_END)
 	{
 		exfat_error("no free space left");
 		return EXFAT_CLUSTER_END;
 	}
 
-	ef->cmap.dirty = true;
 	return cluster;
 }
 
-static void free_cluster(struct exfat* ef, cluster_t cluster)
+/*
+ * Allocate a cluster for the node from its locality window. The window is
+ * a range of free clusters carved for the node so that files written at
+ * the same time do not interleave their clusters. This is about layout
+ * only: like the rest of the library it relies on the caller to serialize
+ * operations, and windows are not reserved in the bitmap, so a cluster
+ * taken by someone else makes the node carve a new window. Only a few
+ * files grow at the same time, so windows live in a small table and a node
+ * keeps just its slot there. Slots are given out in turn; a node that has
+ * lost its slot to another one takes the oldest slot and carves a new
+ * window, which costs its file one more fragment. Without windows this is
+ * just allocate_cluster().
+ */
+static cluster_t allocate_local_cluster(struct exfat* ef,
+		struct exfat_node* node, cluster_t hint)
 {
-	if (cluster - EXFAT_FIRST_DATA_CLUSTER >= ef->cmap.size)
-		exfat_bug("caller must check cluster validity (%#x, %#x)", cluster,
-				ef->cmap.size);
+	struct exfat_locality_window* window;
+	uint32_t index;
 
-	BMAP_CLR(ef->cmap.chunk, cluster - EXFAT_FIRST_DATA_CLUSTER);
-	ef->cmap.dirty = true;
+	if (ef->cmap.window_size == 0)
+		return allocate_cluster(ef, hint);
+
+	window = &ef->cmap.windows[node->window % EXFAT_LOCALITY_WINDOWS];
+	if (window->node != node)
+	{
+		node->window = ef->cmap.window_next++ % EXFAT_LOCALITY_WINDOWS;
+		window = &ef->cmap.windows[node->window];
+		window->node = node;
+		window->cluster = 0;
+		window->count = 0;
+	}
+
+	/* prefer keeping the file contiguous even outside of the window */
+	if (hint != 0 && hint != window->cluster &&
+			!CLUSTER_INVALID(*ef->sb, hint) && is_free(ef, hint))
+		return set_bit(ef, hint - EXFAT_FIRST_DATA_CLUSTER);
+
+	if (window->count != 0 && is_free(ef, window->cluster))
+	{
+		window->count--;
+		return set_bit(ef, window->cluster++ - EXFAT_FIRST_DATA_CLUSTER);
+	}
+
+	/* carve a new window after the most recently carved one */
+	index = find_free_bit(ef, ef->cmap.window_rotor, ef->cmap.size);
+	if (index == ef->cmap.size)
+	{
+		index = find_free_bit(ef, 0, ef->cmap.window_rotor);
+		if (index == ef->cmap.window_rotor)
+			return allocate_cluster(ef, hint); /* reports the error */
+	}
+	window->cluster = index + EXFAT_FIRST_DATA_CLUSTER + 1;
+	window->count = MIN(ef->cmap.window_size, ef->cmap.size - index) - 1;
+	ef->cmap.window_rotor = index + window->count + 1;
+	if (ef->cmap.window_rotor >= ef->cmap.size)
+		ef->cmap.window_rotor = 0;
+	return set_bit(ef, index);
+}
+
+/*
+ * Free a run of count clusters starting from the first one. FAT cells of
+ * freed clusters are left as is: exFAT does not require them to be cleared.
+ */
+static int free_clusters(struct exfat* ef, cluster_t first, uint32_t count)
+{
+	uint32_t start = first - EXFAT_FIRST_DATA_CLUSTER;
+	const uint32_t end = start + count;
+
+	if (start >= ef->cmap.size || count > ef->cmap.size - start)
+		exfat_bug("caller must check clusters validity (%#x, %u, %#x)",
+				first, count, ef->cmap.size);
+
+	while (start < end)
+	{
+		const uint32_t b = start / CMAP_BLOCK_BITS;
+		const uint32_t block_end = MIN((b + 1) * CMAP_BLOCK_BITS, end);
+		int rc;
+
+		rc = clear_block_bits(ef, b, start % CMAP_BLOCK_BITS,
+				block_end - b * CMAP_BLOCK_BITS);
+		if (rc != 0)
+			return rc;
+		start = block_end;
+	}
+	return 0;
+}
+
+/*
+ * Free clusters of chains walked by the worker. If wait is true, wait
+ * until all chains are walked. Returns the number of freed clusters.
+ */
+uint32_t exfat_reclaim_clusters(struct exfat* ef, bool wait)
+{
+	cluster_t first;
+	uint32_t count;
+	uint32_t freed = 0;
+
+	while (exfat_take_orphan_run(ef, wait, &first, &count))
+	{
+		if (free_clusters(ef, first, count) != 0)
+			exfat_error("failed to free clusters 0x%x-0x%x", first,
+					first + count - 1);
+		else
+			freed += count;
+	}
+	return freed;
 }
 
 static bool make_noncontiguous(const struct exfat* ef, cluster_t first,
@@ -236,12 +624,79 @@ static bool make_noncontiguous(const struct exfat* ef, cluster_t first,
 static int shrink_file(struct exfat* ef, struct exfat_node* node,
 		uint32_t current, uint32_t difference);
 
+/*
+ * Let the worker zero free clusters of the pool range.
+ */
+static void fill_zero_pool(struct exfat* ef)
+{
+	const cluster_t first = exfat_zero_pool_first(ef);
+	uint32_t i;
+
+	for (i = 0; i < ef->zero_pool_size; i++)
+	{
+		const uint32_t index = first - EXFAT_FIRST_DATA_CLUSTER + i;
+
+		if (index >= ef->cmap.size)
+			break;
+		if (!cmap_get(ef, index) && !exfat_zero_pool_contains(ef, first + i))
+			exfat_zero_pool_add(ef, first + i);
+	}
+}
+
+/*
+ * Refill the zeroed pool after clusters were taken from it. When less
+ * than a half of the range is left, the range moves to the first free
+ * cluster from the hint, so that a directory growing from the pool stays
+ * near its other clusters. Without a hint the search starts from the
+ * beginning of the volume.
+ */
+void exfat_refill_zero_pool(struct exfat* ef, cluster_t hint)
+{
+	uint32_t index;
+
+	if (ef->worker == NULL || ef->zero_pool_size == 0)
+		return;
+
+	if (exfat_zero_pool_first(ef) != EXFAT_CLUSTER_END)
+	{
+		fill_zero_pool(ef);
+		if (exfat_zero_pool_usable(ef) * 2 >= ef->zero_pool_size)
+			return;
+	}
+
+	if (CLUSTER_INVALID(*ef->sb, hint))
+		hint = EXFAT_FIRST_DATA_CLUSTER;
+	index = find_free_bit(ef, hint - EXFAT_FIRST_DATA_CLUSTER, ef->cmap.size);
+	if (index == ef->cmap.size)
+		index = find_free_bit(ef, 0, ef->cmap.size);
+	if (index == ef->cmap.size)
+		return;
+	exfat_zero_pool_move(ef, index + EXFAT_FIRST_DATA_CLUSTER);
+	fill_zero_pool(ef);
+}
+
+static cluster_t allocate_zeroed_cluster(struct exfat* ef, cluster_t hint)
+{
+	const cluster_t cluster = exfat_zero_pool_take(ef, hint, false);
+
+	if (cluster == EXFAT_CLUSTER_END)
+		exfat_bug("zeroed clusters pool is empty");
+	return set_bit(ef, cluster - EXFAT_FIRST_DATA_CLUSTER);
+}
+
+/*
+ * Grow the file by difference clusters. If zeroed is not NULL, the new
+ * clusters may be taken from the zeroed pool, then *zeroed is set to true
+ * and they need not be erased. The pool is used when all of them fit in
+ * it; a pooled cluster that continues the file is preferred.
+ */
 static int grow_file(struct exfat* ef, struct exfat_node* node,
-		uint32_t current, uint32_t difference)
+		uint32_t current, uint32_t difference, bool* zeroed)
 {
 	cluster_t previous;
 	cluster_t next;
 	uint32_t allocated = 0;
+	bool use_pool = false;
 
 	if (difference == 0)
 		exfat_bug("zero clusters count passed");
@@ -255,16 +710,21 @@ static int grow_file(struct exfat* ef, struct exfat_node* node,
 			exfat_error("invalid cluster 0x%x while growing", previous);
 			return -EIO;
 		}
+		use_pool = zeroed != NULL &&
+				difference <= exfat_zero_pool_ready(ef);
 	}
 	else
 	{
 		if (node->fptr_index != 0)
 			exfat_bug("non-zero pointer index (%u)", node->fptr_index);
+		use_pool = zeroed != NULL &&
+				difference <= exfat_zero_pool_ready(ef);
 		/* file does not have clusters (i.e. is empty), allocate
 		   the first one for it */
-		previous = allocate_cluster(ef, 0);
+		previous = use_pool ? allocate_zeroed_cluster(ef, EXFAT_CLUSTER_END) :
+				allocate_local_cluster(ef, node, 0);
 		if (CLUSTER_INVALID(*ef->sb, previous))
-			return -ENOSPC;
+			return previous == CLUSTER_NOMEM ? -ENOMEM : -ENOSPC;
 		node->fptr_cluster = node->start_cluster = previous;
 		allocated = 1;
 		/* file consists of only one cluster, so it's contiguous */
@@ -273,12 +733,13 @@ static int grow_file(struct exfat* ef, struct exfat_node* node,
 
 	while (allocated < difference)
 	{
-		next = allocate_cluster(ef, previous + 1);
+		next = use_pool ? allocate_zeroed_cluster(ef, previous + 1) :
+				allocate_local_cluster(ef, node, previous + 1);
 		if (CLUSTER_INVALID(*ef->sb, next))
 		{
 			if (allocated != 0)
 				shrink_file(ef, node, current + allocated, allocated);
-			return -ENOSPC;
+			return next == CLUSTER_NOMEM ? -ENOMEM : -ENOSPC;
 		}
 		if (next != previous + 1 && node->is_contiguous)
 		{
@@ -287,7 +748,7 @@ static int grow_file(struct exfat* ef, struct exfat_node* node,
 			if (!make_noncontiguous(ef, node->start_cluster, previous))
 				return -EIO;
 			node->is_contiguous = false;
-			node->is_dirty = true;
+			exfat_mark_dirty(ef, node);
 		}
 		if (!set_next_cluster(ef, node->is_contiguous, previous, next))
 			return -EIO;
@@ -298,14 +759,107 @@ static int grow_file(struct exfat* ef, struct exfat_node* node,
 	if (!set_next_cluster(ef, node->is_contiguous, previous,
 			EXFAT_CLUSTER_END))
 		return -EIO;
+	if (use_pool)
+	{
+		*zeroed = true;
+		exfat_refill_zero_pool(ef, previous + 1);
+	}
 	return 0;
 }
 
+/*
+ * A window of FAT cells. Walking a long fragmented chain through it costs
+ * one read per FAT_WINDOW_CELLS cells instead of one read per cluster.
+ */
+#define FAT_WINDOW_CELLS 1024
+
+struct fat_window
+{
+	cluster_t first;
+	uint32_t count;
+	le32_t cells[FAT_WINDOW_CELLS];
+};
+
+static cluster_t fat_window_next(const struct exfat* ef, struct fat_window* w,
+		cluster_t cluster)
+{
+	const cluster_t fat_cells = le32_to_cpu(ef->sb->cluster_count) +
+			EXFAT_FIRST_DATA_CLUSTER;
+
+	if (cluster - w->first >= w->count)
+	{
+		w->first = cluster - cluster % FAT_WINDOW_CELLS;
+		w->count = MIN(FAT_WINDOW_CELLS, fat_cells - w->first);
+		if (exfat_pread(ef->dev, w->cells, w->count * sizeof(le32_t),
+				s2o(ef, le32_to_cpu(ef->sb->fat_sector_start)) +
+				(off_t) w->first * sizeof(le32_t)) < 0)
+		{
+			w->count = 0;
+			return EXFAT_CLUSTER_BAD;
+		}
+	}
+	return le32_to_cpu(w->cells[cluster - w->first]);
+}
+
+/*
+ * Free a chain of count clusters starting from the first one. Physically
+ * adjacent clusters are collected into runs which are freed at once.
+ */
+static int free_chain(struct exfat* ef, bool contiguous, cluster_t first,
+		uint32_t count)
+{
+	struct fat_window w;
+	cluster_t run_start = first;
+	uint32_t run_length = 0;
+
+	if (contiguous)
+	{
+		if (CLUSTER_INVALID(*ef->sb, first) ||
+				CLUSTER_INVALID(*ef->sb, first + count - 1))
+		{
+			exfat_error("invalid clusters 0x%x-0x%x while freeing", first,
+					first + count - 1);
+			return -EIO;
+		}
+		return free_clusters(ef, first, count);
+	}
+
+	/* a long chain is walked by the worker, it is freed on the next
+	   flush */
+	if (count > FAT_WINDOW_CELLS && exfat_orphan_chain(ef, first, count))
+		return 0;
+
+	w.first = w.count = 0;
+	while (count--)
+	{
+		if (CLUSTER_INVALID(*ef->sb, first))
+		{
+			const int rc = run_length != 0 ?
+					free_clusters(ef, run_start, run_length) : 0;
+
+			exfat_error("invalid cluster 0x%x while freeing after shrink",
+					first);
+			return rc != 0 ? rc : -EIO;
+		}
+		if (run_length != 0 && first != run_start + run_length)
+		{
+			int rc = free_clusters(ef, run_start, run_length);
+			if (rc != 0)
+				return rc;
+			run_length = 0;
+		}
+		if (run_length++ == 0)
+			run_start = first;
+		if (count != 0)
+			first = fat_window_next(ef, &w, first);
+	}
+	return free_clusters(ef, run_start, run_length);
+}
+
 static int shrink_file(struct exfat* ef, struct exfat_node* node,
 		uint32_t current, uint32_t difference)
 {
 	cluster_t previous;
-	cluster_t next;
 
 	if (difference == 0)
 		exfat_bug("zero difference passed");
@@ -333,29 +887,13 @@ static int shrink_file(struct exfat* ef, struct exfat_node* node,
 	{
 		previous = node->start_cluster;
 		node->start_cluster = EXFAT_CLUSTER_FREE;
-		node->is_dirty = true;
+		exfat_mark_dirty(ef, node);
 	}
 	node->fptr_index = 0;
 	node->fptr_cluster = node->start_cluster;
 
 	/* free remaining clusters */
-	while (difference--)
-	{
-		if (CLUSTER_INVALID(*ef->sb, previous))
-		{
-			exfat_error("invalid cluster 0x%x while freeing after shrink",
-					previous);
-			return -EIO;
-		}
-
-		next = exfat_next_cluster(ef, node, previous);
-		if (!set_next_cluster(ef, node->is_contiguous, previous,
-				EXFAT_CLUSTER_FREE))
-			return -EIO;
-		free_cluster(ef, previous);
-		previous = next;
-	}
-	return 0;
+	return free_chain(ef, node->is_contiguous, previous, difference);
 }
 
 static bool erase_raw(struct exfat* ef, size_t size, off_t offset)
@@ -408,6 +946,7 @@ int exfat_truncate(struct exfat* ef, struct exfat_node* node, uint64_t size,
 {
 	uint32_t c1 = bytes2clusters(ef, node->size);
 	uint32_t c2 = bytes2clusters(ef, size);
+	bool zeroed = false;
 	int rc = 0;
 
 	if (node->references == 0 && node->parent)
@@ -417,7 +956,7 @@ int exfat_truncate(struct exfat* ef, struct exfat_node* node, uint64_t size,
 		return 0;
 
 	if (c1 < c2)
-		rc = grow_file(ef, node, c1, c2 - c1);
+		rc = grow_file(ef, node, c1, c2 - c1, erase ? &zeroed : NULL);
 	else if (c1 > c2)
 		rc = shrink_file(ef, node, c1, c1 - c2);
 
@@ -426,7 +965,9 @@ int exfat_truncate(struct exfat* ef, struct exfat_node* node, uint64_t size,
 
 	if (erase)
 	{
-		rc = erase_range(ef, node, node->valid_size, size);
+		/* new clusters from the zeroed pool need no erase */
+		rc = erase_range(ef, node, node->valid_size, zeroed ?
+				MIN(size, (uint64_t) c1 * CLUSTER_SIZE(*ef->sb)) : size);
 		if (rc != 0)
 			return rc;
 		node->valid_size = size;
@@ -436,20 +977,18 @@ int exfat_truncate(struct exfat* ef, struct exfat_node* node, uint64_t size,
 		node->valid_size = MIN(node->valid_size, size);
 	}
 
-	exfat_update_mtime(node);
+	exfat_update_mtime(ef, node);
 	node->size = size;
-	node->is_dirty = true;
 	return 0;
 }
 
 uint32_t exfat_count_free_clusters(const struct exfat* ef)
 {
 	uint32_t free_clusters = 0;
-	uint32_t i;
+	uint32_t b;
 
-	for (i = 0; i < ef->cmap.size; i++)
-		if (BMAP_GET(ef->cmap.chunk, i) == 0)
-			free_clusters++;
+	for (b = 0; b < ef->cmap.block_count; b++)
+		free_clusters += ef->cmap.free_counts[b];
 	return free_clusters;
 }
 
@@ -460,14 +999,14 @@ static int find_used_clusters(const struct exfat* ef,
 
 	/* find first used cluster */
 	for (*a = *b + 1; *a < end; (*a)++)
-		if (BMAP_GET(ef->cmap.chunk, *a - EXFAT_FIRST_DATA_CLUSTER))
+		if (cmap_get(ef, *a - EXFAT_FIRST_DATA_CLUSTER))
 			break;
 	if (*a >= end)
 		return 1;
 
 	/* find last contiguous used cluster */
 	for (*b = *a; *b < end; (*b)++)
-		if (BMAP_GET(ef->cmap.chunk, *b - EXFAT_FIRST_DATA_CLUSTER) == 0)
+		if (!cmap_get(ef, *b - EXFAT_FIRST_DATA_CLUSTER))
 		{
 			(*b)--;
 			break;
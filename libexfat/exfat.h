@@ -67,28 +67,59 @@
    be corrupted with 32-bit off_t. */
 STATIC_ASSERT(sizeof(off_t) == 8);
 
+struct exfat_node_index;
+struct exfat_slot_map;
+struct exfat_name_chunk;
+
+/* Data that only cached directories have. */
+struct exfat_dir_cache
+{
+	struct exfat_node* child;			/* the first child */
+	struct exfat_node_index* index;		/* children by name hash */
+	struct exfat_slot_map* slots;		/* free entries */
+	struct exfat_name_chunk* names;		/* children names */
+	size_t names_size;					/* bytes in names chunks */
+	size_t names_used;					/* bytes taken by live names */
+	uint32_t count;						/* children */
+	uint32_t generation;				/* changes when children do */
+	size_t charged;						/* bytes counted in the cache size */
+	struct exfat_node* lru_prev;		/* more recently used directory */
+	struct exfat_node* lru_next;		/* less recently used directory */
+	struct exfat_node* holey_next;		/* next directory to compact */
+	bool has_holes;						/* removed entries left holes */
+	bool has_reserve;					/* grown ahead of need */
+};
+
 struct exfat_node
 {
 	struct exfat_node* parent;
-	struct exfat_node* child;
 	struct exfat_node* next;
 	struct exfat_node* prev;
+	struct exfat_node* hash_next;		/* in parent's index bucket */
+	struct exfat_dir_cache* cache;		/* NULL unless cached directory */
+	const char* name;					/* UTF-8, in parent's names */
 
 	int references;
 	uint32_t fptr_index;
 	cluster_t fptr_cluster;
-	off_t entry_offset;
+	uint32_t entry_offset;
 	cluster_t start_cluster;
 	uint16_t attrib;
+	uint16_t name_hash;
+	le16_t crtime, crdate;		/* creation time, kept as is */
+	uint8_t crtime_cs, crtime_tzo;
+	uint8_t name_length;		/* in UTF-16 characters */
 	uint8_t continuations;
+	uint32_t dirty_index;		/* position in the dirty nodes list */
 	bool is_contiguous : 1;
 	bool is_cached : 1;
 	bool is_dirty : 1;
 	bool is_unlinked : 1;
+	bool is_name_owned : 1;		/* name is malloc'ed, not in parent's names */
+	uint8_t window;				/* slot in the locality windows table */
 	uint64_t valid_size;
 	uint64_t size;
 	time_t mtime, atime;
-	le16_t name[EXFAT_NAME_MAX + 1];
 };
 
 enum exfat_mode
@@ -99,6 +130,20 @@ enum exfat_mode
 };
 
 struct exfat_dev;
+struct exfat_worker;
+struct exfat_node_block;
+struct exfat_dir_reader;
+struct exfat_path_entry;
+
+#define EXFAT_LOCALITY_WINDOWS 16
+
+/* Clusters kept for a growing file so that it stays contiguous. */
+struct exfat_locality_window
+{
+	const struct exfat_node* node;
+	cluster_t cluster;			/* next cluster of the window */
+	uint32_t count;				/* clusters left in the window */
+};
 
 struct exfat
 {
@@ -110,13 +155,55 @@ struct exfat
 	{
 		cluster_t start_cluster;
 		uint32_t size;				/* in bits */
-		bitmap_t* chunk;
-		uint32_t chunk_size;		/* in bits */
+		bitmap_t** blocks;
+		uint16_t* free_counts;		/* free clusters in each block */
+		bitmap_t* dirty_blocks;		/* blocks to be written on flush */
+		uint32_t block_count;
+		bitmap_t* zero_block;		/* shared by all-free blocks */
+		bitmap_t* full_block;		/* shared by all-used blocks */
+		uint32_t window_size;		/* locality window, 0 if disabled */
+		uint32_t window_rotor;		/* where to carve the next window */
+		uint32_t window_next;		/* table slot to give out next */
+		struct exfat_locality_window windows[EXFAT_LOCALITY_WINDOWS];
 		bool dirty;
 	}
 	cmap;
+	struct
+	{
+		struct exfat_node_block* blocks;	/* the first one is being carved */
+		uint32_t unused;			/* nodes left in the first block */
+		struct exfat_node* free;	/* freed nodes linked by next */
+	}
+	nodes;
+	struct
+	{
+		struct exfat_node* lru_head;	/* most recently used directory */
+		struct exfat_node* lru_tail;	/* least recently used directory */
+		size_t size;				/* estimated bytes in cached directories */
+		size_t limit;				/* 0 if unlimited */
+		struct exfat_node* holey;	/* directories to compact */
+	}
+	dcache;
+	struct
+	{
+		struct exfat_node** nodes;	/* nodes that may need flushing */
+		uint32_t count;
+		uint32_t size;
+		bool overflow;				/* some dirty nodes are not listed */
+	}
+	dirty;
+	struct
+	{
+		struct exfat_path_entry* entries;	/* resolved paths */
+		uint32_t generation;		/* changes when paths can dangle */
+	}
+	paths;
 	char label[EXFAT_UTF8_ENAME_BUFFER_MAX];
 	void* zero_cluster;
+	uint32_t zero_pool_size;		/* pre-zeroed clusters, 0 if disabled */
+	bool lazy_free;					/* free long chains in background */
+	bool compact;					/* compact directories on unmount */
+	struct exfat_worker* worker;
 	int dmask, fmask;
 	uid_t uid;
 	gid_t gid;
@@ -132,6 +219,35 @@ struct exfat_iterator
 	struct exfat_node* current;
 };
 
+/* directory entry read without creating a node */
+struct exfat_dirent
+{
+	char name[EXFAT_UTF8_NAME_BUFFER_MAX];
+	uint16_t attrib;
+	uint64_t size;
+	time_t mtime, atime;
+};
+
+/* file to create with exfat_create_batch(); the function returns 0 or
+   a negative error code and sets *created to the number of files created
+   from the start of the array, so on an error the caller knows where to
+   resume */
+struct exfat_new_file
+{
+	const char* name;					/* a single path component */
+	uint16_t attrib;					/* EXFAT_ATTRIB_xxx */
+};
+
+/* on-disk directory entries iterator */
+struct exfat_dir_stream
+{
+	struct exfat_node* dir;
+	struct exfat_node* current;			/* if the directory is cached */
+	struct exfat_dir_reader* reader;	/* if it is not */
+	off_t offset;						/* to continue from */
+	bool eof;
+};
+
 struct exfat_human_bytes
 {
 	uint64_t value;
@@ -158,7 +274,8 @@ ssize_t exfat_pread(struct exfat_dev* dev, void* buffer, size_t size,
 		off_t offset);
 ssize_t exfat_pwrite(struct exfat_dev* dev, const void* buffer, size_t size,
 		off_t offset);
-ssize_t exfat_generic_pread(const struct exfat* ef, struct exfat_node* node,
+void exfat_prefetch(struct exfat_dev* dev, size_t size, off_t offset);
+ssize_t exfat_generic_pread(struct exfat* ef, struct exfat_node* node,
 		void* buffer, size_t size, off_t offset);
 ssize_t exfat_generic_pwrite(struct exfat* ef, struct exfat_node* node,
 		const void* buffer, size_t size, off_t offset);
@@ -169,23 +286,62 @@ void exfat_closedir(struct exfat* ef, struct exfat_iterator* it);
 struct exfat_node* exfat_readdir(struct exfat_iterator* it);
 int exfat_lookup(struct exfat* ef, struct exfat_node** node,
 		const char* path);
+int exfat_lookup_name(struct exfat* ef, struct exfat_node* parent,
+		struct exfat_node** node, const char* name, size_t n);
+void exfat_index_directory(struct exfat* ef, struct exfat_node* dir);
+void exfat_index_add(struct exfat_node* dir, struct exfat_node* node);
+void exfat_index_remove(struct exfat_node* dir, struct exfat_node* node);
+void exfat_free_index(struct exfat_node* dir);
+void exfat_free_paths(struct exfat* ef);
+
+int exfat_resize_slots(struct exfat_node* dir, uint32_t count);
+void exfat_free_slots(struct exfat_node* dir);
+void exfat_use_slots(struct exfat_node* dir, uint32_t first, uint32_t n);
+void exfat_release_slots(struct exfat_node* dir, uint32_t first, uint32_t n);
+uint32_t exfat_find_slots(const struct exfat_node* dir, uint32_t n);
+uint32_t exfat_count_tail_slots(const struct exfat_node* dir);
+uint32_t exfat_count_used_slots(const struct exfat_node* dir);
+void exfat_anchor_child(struct exfat_node* dir, struct exfat_node* node);
+void exfat_unanchor_child(struct exfat_node* dir, struct exfat_node* node);
+struct exfat_node* exfat_find_prev_child(const struct exfat_node* dir,
+		off_t offset);
 int exfat_split(struct exfat* ef, struct exfat_node** parent,
 		struct exfat_node** node, le16_t* name, const char* path);
+int exfat_convert_name(le16_t* name, const char* comp);
 
 off_t exfat_c2o(const struct exfat* ef, cluster_t cluster);
 cluster_t exfat_next_cluster(const struct exfat* ef,
 		const struct exfat_node* node, cluster_t cluster);
 cluster_t exfat_advance_cluster(const struct exfat* ef,
 		struct exfat_node* node, uint32_t count);
-int exfat_flush_nodes(struct exfat* ef);
 int exfat_flush(struct exfat* ef);
+uint32_t exfat_reclaim_clusters(struct exfat* ef, bool wait);
 int exfat_truncate(struct exfat* ef, struct exfat_node* node, uint64_t size,
 		bool erase);
 uint32_t exfat_count_free_clusters(const struct exfat* ef);
+bool exfat_is_cluster_allocated(const struct exfat* ef, cluster_t cluster);
+int exfat_load_cmap(struct exfat* ef);
+void exfat_free_cmap(struct exfat* ef);
 int exfat_find_used_sectors(const struct exfat* ef, off_t* a, off_t* b);
+void exfat_refill_zero_pool(struct exfat* ef, cluster_t hint);
+
+int exfat_start_worker(struct exfat* ef);
+void exfat_stop_worker(struct exfat* ef);
+bool exfat_zero_pool_contains(const struct exfat* ef, cluster_t cluster);
+cluster_t exfat_zero_pool_first(const struct exfat* ef);
+uint32_t exfat_zero_pool_ready(const struct exfat* ef);
+uint32_t exfat_zero_pool_usable(const struct exfat* ef);
+void exfat_zero_pool_add(struct exfat* ef, cluster_t cluster);
+void exfat_zero_pool_move(struct exfat* ef, cluster_t first);
+cluster_t exfat_zero_pool_take(struct exfat* ef, cluster_t hint, bool any);
+bool exfat_orphan_chain(struct exfat* ef, cluster_t first, uint32_t count);
+bool exfat_take_orphan_run(struct exfat* ef, bool wait, cluster_t* first,
+		uint32_t* count);
 
 void exfat_stat(const struct exfat* ef, const struct exfat_node* node,
 		struct stat* stbuf);
+void exfat_stat_dirent(const struct exfat* ef,
+		const struct exfat_dirent* dirent, struct stat* stbuf);
 void exfat_get_name(const struct exfat_node* node,
 		char buffer[EXFAT_UTF8_NAME_BUFFER_MAX]);
 uint16_t exfat_start_checksum(const struct exfat_entry_meta1* entry);
@@ -211,15 +367,35 @@ void exfat_put_node(struct exfat* ef, struct exfat_node* node);
 int exfat_cleanup_node(struct exfat* ef, struct exfat_node* node);
 int exfat_cache_directory(struct exfat* ef, struct exfat_node* dir);
 void exfat_reset_cache(struct exfat* ef);
+int exfat_compact_directories(struct exfat* ef);
+int exfat_trim_directories(struct exfat* ef);
+int exfat_open_stream(struct exfat* ef, struct exfat_node* dir,
+		struct exfat_dir_stream* stream);
+int exfat_read_stream(struct exfat* ef, struct exfat_dir_stream* stream,
+		struct exfat_dirent* dirent);
+int exfat_seek_stream(struct exfat* ef, struct exfat_dir_stream* stream,
+		off_t offset);
+void exfat_close_stream(struct exfat* ef, struct exfat_dir_stream* stream);
+int exfat_get_dirent_node(struct exfat* ef, struct exfat_dir_stream* stream,
+		const struct exfat_dirent* dirent, struct exfat_node** node);
+void exfat_free_nodes(struct exfat* ef);
 int exfat_flush_node(struct exfat* ef, struct exfat_node* node);
+int exfat_flush_nodes(struct exfat* ef);
+void exfat_mark_dirty(struct exfat* ef, struct exfat_node* node);
 int exfat_unlink(struct exfat* ef, struct exfat_node* node);
 int exfat_rmdir(struct exfat* ef, struct exfat_node* node);
+int exfat_remove_tree(struct exfat* ef, struct exfat_node* dir);
 int exfat_mknod(struct exfat* ef, const char* path);
 int exfat_mkdir(struct exfat* ef, const char* path);
+int exfat_create(struct exfat* ef, const char* path, uint16_t attrib,
+		struct exfat_node** node);
+int exfat_create_batch(struct exfat* ef, struct exfat_node* dir,
+		const struct exfat_new_file* files, size_t count, size_t* created);
 int exfat_rename(struct exfat* ef, const char* old_path, const char* new_path);
-void exfat_utimes(struct exfat_node* node, const struct timespec tv[2]);
-void exfat_update_atime(struct exfat_node* node);
-void exfat_update_mtime(struct exfat_node* node);
+void exfat_utimes(struct exfat* ef, struct exfat_node* node,
+		const struct timespec tv[2]);
+void exfat_update_atime(struct exfat* ef, struct exfat_node* node);
+void exfat_update_mtime(struct exfat* ef, struct exfat_node* node);
 const char* exfat_get_label(struct exfat* ef);
 int exfat_set_label(struct exfat* ef, const char* label);
 
@@ -236,7 +412,7 @@ void exfat_tzset(void);
 bool exfat_ask_to_fix(const struct exfat* ef);
 bool exfat_fix_invalid_vbr_checksum(const struct exfat* ef, void* sector,
 		uint32_t vbr_checksum);
-bool exfat_fix_invalid_node_checksum(const struct exfat* ef,
+bool exfat_fix_invalid_node_checksum(struct exfat* ef,
 		struct exfat_node* node);
 bool exfat_fix_unknown_entry(struct exfat* ef, struct exfat_node* dir,
 		const struct exfat_entry* entry, off_t offset);
@@ -387,7 +387,19 @@ ssize_t exfat_pwrite(struct exfat_dev* dev, const void* buffer, size_t size,
 #endif
 }
 
-ssize_t exfat_generic_pread(const struct exfat* ef, struct exfat_node* node,
+/*
+ * Hint that the range will be read soon, so that reading it can start in
+ * background. Does nothing where this is not supported.
+ */
+void exfat_prefetch(UNUSED struct exfat_dev* dev, UNUSED size_t size,
+		UNUSED off_t offset)
+{
+#ifdef POSIX_FADV_WILLNEED
+	posix_fadvise(dev->fd, offset, size, POSIX_FADV_WILLNEED); /* ignore rc */
+#endif
+}
+
+ssize_t exfat_generic_pread(struct exfat* ef, struct exfat_node* node,
 		void* buffer, size_t size, off_t offset)
 {
 	uint64_t uoffset = offset;
@@ -447,7 +459,7 @@ ssize_t exfat_generic_pread(const struct exfat* ef, struct exfat_node* node,
 		cluster = exfat_next_cluster(ef, node, cluster);
 	}
 	if (!(node->attrib & EXFAT_ATTRIB_DIR) && !ef->ro && !ef->noatime)
-		exfat_update_atime(node);
+		exfat_update_atime(ef, node);
 	return MIN(size, node->size - uoffset) - remainder;
 }
 
@@ -509,6 +521,6 @@ ssize_t exfat_generic_pwrite(struct exfat* ef, struct exfat_node* node,
 	if (!(node->attrib & EXFAT_ATTRIB_DIR))
 		/* directory's mtime should be updated by the caller only when it
 		   creates or removes something in this directory */
-		exfat_update_mtime(node);
+		exfat_update_mtime(ef, node);
 	return size - remainder;
 }
@@ -21,6 +21,7 @@
 */
 
 #include "exfat.h"
+#include <stdlib.h>
 #include <string.h>
 #include <errno.h>
 #include <inttypes.h>
@@ -49,7 +50,7 @@ void exfat_closedir(struct exfat* ef, struct exfat_iterator* it)
 struct exfat_node* exfat_readdir(struct exfat_iterator* it)
 {
 	if (it->current == NULL)
-		it->current = it->parent->child;
+		it->current = it->parent->cache->child;
 	else
 		it->current = it->current->next;
 
@@ -77,11 +78,178 @@ static int compare_name(struct exfat* ef, const le16_t* a, const le16_t* b)
 	return compare_char(ef, le16_to_cpu(*a), le16_to_cpu(*b));
 }
 
-static int lookup_name(struct exfat* ef, struct exfat_node* parent,
+/*
+ * Names are cached in UTF-8, get the UTF-16 form back.
+ */
+static int get_utf16_name(const struct exfat_node* node,
+		le16_t name[EXFAT_NAME_MAX + 1])
+{
+	return exfat_utf8_to_utf16(name, node->name, EXFAT_NAME_MAX + 1,
+			strlen(node->name));
+}
+
+static int compare_node_name(struct exfat* ef, const le16_t* name,
+		const struct exfat_node* node)
+{
+	le16_t node_name[EXFAT_NAME_MAX + 1];
+	int rc;
+
+	/* a name that cannot be converted back matches nothing */
+	rc = get_utf16_name(node, node_name);
+	if (rc != 0)
+		return rc;
+	return compare_name(ef, name, node_name);
+}
+
+/*
+ * Index of directory children by name hash. The hash is the one stored in
+ * the file info entry: it is calculated over the upcased name, so all
+ * names that compare equal land in the same bucket.
+ */
+#define INDEX_MIN_BUCKETS 16
+#define INDEX_MAX_BUCKETS 65536	/* name hash is 16 bits wide */
+
+struct exfat_node_index
+{
+	struct exfat_node** buckets;
+	uint32_t size;				/* number of buckets, power of 2 */
+	uint32_t count;				/* indexed nodes */
+};
+
+static struct exfat_node** get_bucket(struct exfat_node_index* index,
+		uint16_t hash)
+{
+	return index->buckets + (hash & (index->size - 1));
+}
+
+static void insert_node(struct exfat_node_index* index,
+		struct exfat_node* node)
+{
+	struct exfat_node** bucket = get_bucket(index, node->name_hash);
+
+	node->hash_next = *bucket;
+	*bucket = node;
+	index->count++;
+}
+
+/*
+ * Change the number of buckets. On failure the index stays as is: it just
+ * works slower.
+ */
+static void resize_index(struct exfat_node_index* index, uint32_t size)
+{
+	struct exfat_node** old_buckets = index->buckets;
+	const uint32_t old_size = index->size;
+	uint32_t i;
+
+	index->buckets = calloc(size, sizeof(struct exfat_node*));
+	if (index->buckets == NULL)
+	{
+		index->buckets = old_buckets;
+		return;
+	}
+	index->size = size;
+	index->count = 0;
+	for (i = 0; i < old_size; i++)
+		while (old_buckets[i] != NULL)
+		{
+			struct exfat_node* node = old_buckets[i];
+
+			old_buckets[i] = node->hash_next;
+			insert_node(index, node);
+		}
+	free(old_buckets);
+}
+
+void exfat_index_add(struct exfat_node* dir, struct exfat_node* node)
+{
+	struct exfat_node_index* index;
+
+	if (dir->cache == NULL || dir->cache->index == NULL)
+		return;
+	index = dir->cache->index;
+	if (index->count >= 2 * index->size && index->size < INDEX_MAX_BUCKETS)
+		resize_index(index, index->size * 2);
+	insert_node(index, node);
+}
+
+void exfat_index_remove(struct exfat_node* dir, struct exfat_node* node)
+{
+	struct exfat_node** p;
+
+	if (dir->cache == NULL || dir->cache->index == NULL)
+		return;
+	for (p = get_bucket(dir->cache->index, node->name_hash); *p;
+			p = &(*p)->hash_next)
+		if (*p == node)
+		{
+			*p = node->hash_next;
+			node->hash_next = NULL;
+			dir->cache->index->count--;
+			return;
+		}
+	exfat_bug("node is not in its parent index");
+}
+
+/*
+ * Build the index for a freshly cached directory. Without the index
+ * lookups fall back to a linear scan, so allocation failures are ignored.
+ */
+void exfat_index_directory(struct exfat* ef, struct exfat_node* dir)
+{
+	struct exfat_node_index* index;
+	struct exfat_node* node;
+	le16_t name[EXFAT_NAME_MAX + 1];
+	uint32_t count = 0;
+	uint32_t size = INDEX_MIN_BUCKETS;
+
+	if (ef->upcase == NULL)
+		return; /* broken volume, mount will fail anyway */
+
+	for (node = dir->cache->child; node; node = node->next)
+		count++;
+	while (2 * size < count && size < INDEX_MAX_BUCKETS)
+		size *= 2;
+
+	index = malloc(sizeof(struct exfat_node_index));
+	if (index == NULL)
+		return;
+	index->buckets = calloc(size, sizeof(struct exfat_node*));
+	if (index->buckets == NULL)
+	{
+		free(index);
+		return;
+	}
+	index->size = size;
+	index->count = 0;
+
+	for (node = dir->cache->child; node; node = node->next)
+	{
+		/* do not trust hashes written by someone else, unless there is
+		   nothing better */
+		if (get_utf16_name(node, name) == 0)
+			node->name_hash = le16_to_cpu(exfat_calc_name_hash(ef, name,
+					node->name_length));
+		insert_node(index, node);
+	}
+	dir->cache->index = index;
+}
+
+void exfat_free_index(struct exfat_node* dir)
+{
+	if (dir->cache == NULL || dir->cache->index == NULL)
+		return;
+	free(dir->cache->index->buckets);
+	free(dir->cache->index);
+	dir->cache->index = NULL;
+}
+
+int exfat_lookup_name(struct exfat* ef, struct exfat_node* parent,
 		struct exfat_node** node, const char* name, size_t n)
 {
 	struct exfat_iterator it;
 	le16_t buffer[EXFAT_NAME_MAX + 1];
+	uint16_t hash;
 	int rc;
 
 	*node = NULL;
@@ -93,9 +261,25 @@ static int lookup_name(struct exfat* ef, struct exfat_node* parent,
 	rc = exfat_opendir(ef, parent, &it);
 	if (rc != 0)
 		return rc;
+	if (parent->cache->index != NULL)
+	{
+		hash = le16_to_cpu(exfat_calc_name_hash(ef, buffer,
+				exfat_utf16_length(buffer)));
+		for (*node = *get_bucket(parent->cache->index, hash); *node;
+				*node = (*node)->hash_next)
+			if ((*node)->name_hash == hash &&
+					compare_node_name(ef, buffer, *node) == 0)
+			{
+				exfat_get_node(*node);
+				exfat_closedir(ef, &it);
+				return 0;
+			}
+		exfat_closedir(ef, &it);
+		return -ENOENT;
+	}
 	while ((*node = exfat_readdir(&it)))
 	{
-		if (compare_name(ef, buffer, (*node)->name) == 0)
+		if (compare_node_name(ef, buffer, *node) == 0)
 		{
 			exfat_closedir(ef, &it);
 			return 0;
@@ -118,37 +302,157 @@ static size_t get_comp(const char* path, const char** comp)
 		return end - *comp;
 }
 
-int exfat_lookup(struct exfat* ef, struct exfat_node** node,
-		const char* path)
+static bool is_last_comp(const char* comp, size_t length, const char* end)
 {
+	const char* p = comp + length;
+
+	return get_comp(p, &p) == 0 || p >= end;
+}
+
+/*
+ * Recently resolved paths, both existing and not, are kept in a direct-
+ * mapped table. An entry remembers the directory that has (or lacks) the
+ * last component. It is valid while that directory has the same children
+ * and no directory was renamed or dropped from the cache since. This is
+ * tracked with generation counters, so nothing has to search the table.
+ */
+
+#define PATHS_COUNT 4096
+
+struct exfat_path_entry
+{
+	char* path;
+	size_t length;
+	struct exfat_node* parent;		/* directory of the last component */
+	struct exfat_node* node;		/* NULL if there is no such file */
+	uint32_t generation;			/* of the paths table */
+	uint32_t dir_generation;		/* of the parent */
+};
+
+static struct exfat_path_entry* get_path_entry(const struct exfat* ef,
+		const char* path, size_t length)
+{
+	uint32_t hash = 2166136261u;	/* FNV-1a */
+	size_t i;
+
+	for (i = 0; i < length; i++)
+		hash = (hash ^ (uint8_t) path[i]) * 16777619u;
+	return &ef->paths.entries[hash % PATHS_COUNT];
+}
+
+static const struct exfat_path_entry* find_path(const struct exfat* ef,
+		const char* path, size_t length)
+{
+	const struct exfat_path_entry* entry;
+
+	if (ef->paths.entries == NULL)
+		return NULL;
+	entry = get_path_entry(ef, path, length);
+	if (entry->path == NULL || entry->length != length ||
+			memcmp(entry->path, path, length) != 0)
+		return NULL;
+	/* the parent is still cached if the table generation matches */
+	if (entry->generation != ef->paths.generation ||
+			entry->dir_generation != entry->parent->cache->generation)
+		return NULL;
+	return entry;
+}
+
+static void add_path(struct exfat* ef, const char* path, size_t length,
+		struct exfat_node* parent, struct exfat_node* node)
+{
+	struct exfat_path_entry* entry;
+	char* copy;
+
+	if (parent == NULL || !parent->is_cached)
+		return;
+	if (ef->paths.entries == NULL)
+	{
+		ef->paths.entries = calloc(PATHS_COUNT,
+				sizeof(struct exfat_path_entry));
+		if (ef->paths.entries == NULL)
+			return; /* it is just a cache */
+	}
+	entry = get_path_entry(ef, path, length);
+	if (entry->path == NULL || entry->length < length)
+	{
+		copy = realloc(entry->path, length);
+		if (copy == NULL)
+			return;
+		entry->path = copy;
+	}
+	memcpy(entry->path, path, length);
+	entry->length = length;
+	entry->parent = parent;
+	entry->node = node;
+	entry->generation = ef->paths.generation;
+	entry->dir_generation = parent->cache->generation;
+}
+
+void exfat_free_paths(struct exfat* ef)
+{
+	uint32_t i;
+
+	if (ef->paths.entries == NULL)
+		return;
+	for (i = 0; i < PATHS_COUNT; i++)
+		free(ef->paths.entries[i].path);
+	free(ef->paths.entries);
+	ef->paths.entries = NULL;
+}
+
+/*
+ * Resolve the first length bytes of the path.
+ */
+static int lookup_path(struct exfat* ef, struct exfat_node** node,
+		const char* path, size_t length)
+{
+	const struct exfat_path_entry* entry;
 	struct exfat_node* parent;
+	const char* end;
 	const char* p;
 	size_t n;
 	int rc;
 
+	while (length > 1 && path[length - 1] == '/')
+		length--;
+	end = path + length;
+
+	entry = find_path(ef, path, length);
+	if (entry != NULL)
+	{
+		if (entry->node == NULL)
+			return -ENOENT;
+		*node = exfat_get_node(entry->node);
+		exfat_cache_directory(ef, entry->parent); /* mark as used */
+		return 0;
+	}
+
 	/* start from the root directory */
 	parent = *node = exfat_get_node(ef->root);
-	for (p = path; (n = get_comp(p, &p)); p += n)
+	for (p = path; (n = get_comp(p, &p)) && p < end; p += n)
 	{
 		if (n == 1 && *p == '.')				/* skip "." component */
 			continue;
-		rc = lookup_name(ef, parent, node, p, n);
+		rc = exfat_lookup_name(ef, parent, node, p, n);
 		if (rc != 0)
 		{
+			if (rc == -ENOENT && is_last_comp(p, n, end))
+				add_path(ef, path, length, parent, NULL);
 			exfat_put_node(ef, parent);
 			return rc;
 		}
 		exfat_put_node(ef, parent);
 		parent = *node;
 	}
+	add_path(ef, path, length, (*node)->parent, *node);
 	return 0;
 }
 
-static bool is_last_comp(const char* comp, size_t length)
+int exfat_lookup(struct exfat* ef, struct exfat_node** node,
+		const char* path)
 {
-	const char* p = comp + length;
-
-	return get_comp(p, &p) == 0;
+	return lookup_path(ef, node, path, strlen(path));
 }
 
 static bool is_allowed(const char* comp, size_t length)
@@ -173,50 +477,61 @@ static bool is_allowed(const char* comp, size_t length)
 	return true;
 }
 
+/*
+ * Convert a file name (a single path component) to UTF-16. Fails if it
+ * cannot name a file.
+ */
+int exfat_convert_name(le16_t* name, const char* comp)
+{
+	const size_t n = strlen(comp);
+
+	if (n == 0 || strcmp(comp, ".") == 0 || strcmp(comp, "..") == 0 ||
+			!is_allowed(comp, n))
+		return -EINVAL;
+	memset(name, 0, (EXFAT_NAME_MAX + 1) * sizeof(le16_t));
+	return exfat_utf8_to_utf16(name, comp, EXFAT_NAME_MAX + 1, n);
+}
+
 int exfat_split(struct exfat* ef, struct exfat_node** parent,
 		struct exfat_node** node, le16_t* name, const char* path)
 {
 	const char* p;
+	const char* last = NULL;
 	size_t n;
 	int rc;
 
 	memset(name, 0, (EXFAT_NAME_MAX + 1) * sizeof(le16_t));
-	*parent = *node = exfat_get_node(ef->root);
 	for (p = path; (n = get_comp(p, &p)); p += n)
+		last = p;
+	if (last == NULL)
+		exfat_bug("impossible");
+	n = get_comp(last, &p);
+	if (n == 1 && *last == '.')
+		exfat_bug("impossible");
+
+	/* resolve the parent as a whole, it's likely to be remembered */
+	rc = lookup_path(ef, parent, path, last - path);
+	if (rc != 0)
+		return rc;
+
+	if (!is_allowed(last, n))
 	{
-		if (n == 1 && *p == '.')
-			continue;
-		if (is_last_comp(p, n))
-		{
-			if (!is_allowed(p, n))
-			{
-				/* contains characters that are not allowed */
-				exfat_put_node(ef, *parent);
-				return -ENOENT;
-			}
-			rc = exfat_utf8_to_utf16(name, p, EXFAT_NAME_MAX + 1, n);
-			if (rc != 0)
-			{
-				exfat_put_node(ef, *parent);
-				return rc;
-			}
+		/* contains characters that are not allowed */
+		exfat_put_node(ef, *parent);
+		return -ENOENT;
+	}
+	rc = exfat_utf8_to_utf16(name, last, EXFAT_NAME_MAX + 1, n);
+	if (rc != 0)
+	{
+		exfat_put_node(ef, *parent);
+		return rc;
+	}
 
-			rc = lookup_name(ef, *parent, node, p, n);
-			if (rc != 0 && rc != -ENOENT)
-			{
-				exfat_put_node(ef, *parent);
-				return rc;
-			}
-			return 0;
-		}
-		rc = lookup_name(ef, *parent, node, p, n);
-		if (rc != 0)
-		{
-			exfat_put_node(ef, *parent);
-			return rc;
-		}
+	rc = exfat_lookup_name(ef, *parent, node, last, n);
+	if (rc != 0 && rc != -ENOENT)
+	{
 		exfat_put_node(ef, *parent);
-		*parent = *node;
+		return rc;
 	}
-	exfat_bug("impossible");
+	return 0;
 }
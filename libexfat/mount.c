@@ -92,6 +92,13 @@ static void parse_options(struct exfat* ef, const char* options)
 
 	ef->noatime = exfat_match_option(options, "noatime");
 
+	ef->cmap.window_size = get_int_option(options, "alloc_window", 10, 0);
+	ef->zero_pool_size = get_int_option(options, "zero_pool", 10, 0);
+	ef->lazy_free = exfat_match_option(options, "lazy_free");
+	ef->compact = exfat_match_option(options, "compact");
+	ef->dcache.limit = (size_t) get_int_option(options, "cache_limit", 10, 0)
+			<< 20;
+
 	switch (get_int_option(options, "repair", 10, 0))
 	{
 	case 1:
@@ -166,14 +173,19 @@ int exfat_soil_super_block(const struct exfat* ef)
 
 static void exfat_free(struct exfat* ef)
 {
+	exfat_stop_worker(ef);	/* it writes to the device */
 	exfat_close(ef->dev);	/* first of all, close the descriptor */
 	ef->dev = NULL;			/* struct exfat_dev is freed by exfat_close() */
 	free(ef->root);
 	ef->root = NULL;
+	exfat_free_nodes(ef);
+	exfat_free_paths(ef);
 	free(ef->zero_cluster);
 	ef->zero_cluster = NULL;
-	free(ef->cmap.chunk);
-	ef->cmap.chunk = NULL;
+	exfat_free_cmap(ef);
+	free(ef->dirty.nodes);
+	ef->dirty.nodes = NULL;
+	ef->dirty.count = ef->dirty.size = 0;
 	free(ef->upcase);
 	ef->upcase = NULL;
 	free(ef->sb);
@@ -304,7 +316,7 @@ int exfat_mount(struct exfat* ef, const char* spec, const char* options)
 	ef->root->attrib = EXFAT_ATTRIB_DIR;
 	ef->root->start_cluster = le32_to_cpu(ef->sb->rootdir_cluster);
 	ef->root->fptr_cluster = ef->root->start_cluster;
-	ef->root->name[0] = cpu_to_le16('\0');
+	ef->root->name = "";	/* the root directory has no name */
 	ef->root->valid_size = ef->root->size = rootdir_size(ef);
 	if (ef->root->size == 0)
 	{
@@ -325,12 +337,11 @@ int exfat_mount(struct exfat* ef, const char* spec, const char* options)
 		exfat_error("upcase table is not found");
 		goto error;
 	}
-	if (ef->cmap.chunk == NULL)
+	if (ef->cmap.blocks == NULL)
 	{
 		exfat_error("clusters bitmap is not found");
 		goto error;
 	}
-
 	return 0;
 
 error:
@@ -364,7 +375,11 @@ static void finalize_super_block(struct exfat* ef)
 
 void exfat_unmount(struct exfat* ef)
 {
+	exfat_trim_directories(ef);		/* ignore return code */
+	if (ef->compact)
+		exfat_compact_directories(ef);	/* ignore return code */
 	exfat_flush_nodes(ef);	/* ignore return code */
+	exfat_reclaim_clusters(ef, true);
 	exfat_flush(ef);		/* ignore return code */
 	exfat_put_node(ef, ef->root);
 	exfat_reset_cache(ef);
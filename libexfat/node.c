@@ -55,6 +55,79 @@ void exfat_put_node(struct exfat* ef, struct exfat_node* node)
 	}
 }
 
+/*
+ * Nodes are carved from large blocks owned by the mount. Freed nodes go to
+ * a free list and are reused; blocks are released only on unmount. This
+ * turns caching and dropping a directory of millions of files into a few
+ * allocations instead of millions of malloc() and free() calls.
+ */
+
+#define NODE_BLOCK_SIZE 65536	/* bytes */
+
+struct exfat_node_block
+{
+	struct exfat_node_block* next;
+	struct exfat_node nodes[];
+};
+
+#define NODES_PER_BLOCK ((NODE_BLOCK_SIZE - sizeof(struct exfat_node_block)) \
+		/ sizeof(struct exfat_node))
+
+static struct exfat_node* allocate_node(struct exfat* ef)
+{
+	struct exfat_node* node;
+
+	if (ef->nodes.free != NULL)
+	{
+		node = ef->nodes.free;
+		ef->nodes.free = node->next;
+	}
+	else
+	{
+		if (ef->nodes.unused == 0)
+		{
+			struct exfat_node_block* block = malloc(NODE_BLOCK_SIZE);
+			if (block == NULL)
+			{
+				exfat_error("failed to allocate node");
+				return NULL;
+			}
+			block->next = ef->nodes.blocks;
+			ef->nodes.blocks = block;
+			ef->nodes.unused = NODES_PER_BLOCK;
+		}
+		node = &ef->nodes.blocks->nodes[NODES_PER_BLOCK - ef->nodes.unused--];
+	}
+	memset(node, 0, sizeof(struct exfat_node));
+	return node;
+}
+
+static void unlist_dirty(struct exfat* ef, struct exfat_node* node);
+
+static void free_node(struct exfat* ef, struct exfat_node* node)
+{
+	unlist_dirty(ef, node);
+	node->next = ef->nodes.free;
+	ef->nodes.free = node;
+}
+
+/*
+ * Release memory of all nodes at once. No node may be used after this.
+ */
+void exfat_free_nodes(struct exfat* ef)
+{
+	while (ef->nodes.blocks != NULL)
+	{
+		struct exfat_node_block* next = ef->nodes.blocks->next;
+		free(ef->nodes.blocks);
+		ef->nodes.blocks = next;
+	}
+	ef->nodes.unused = 0;
+	ef->nodes.free = NULL;
+}
+
+static void uncache_directory(struct exfat* ef, struct exfat_node* dir);
+
 /**
  * This function must be called on rmdir and unlink (after the last
  * exfat_put_node()) to free clusters.
@@ -71,8 +144,11 @@ int exfat_cleanup_node(struct exfat* ef, struct exfat_node* node)
 	{
 		/* free all clusters and node structure itself */
 		rc = exfat_truncate(ef, node, 0, true);
+		uncache_directory(ef, node);
+		if (node->is_name_owned)
+			free((char*) node->name);
 		/* free the node even in case of error or its memory will be lost */
-		free(node);
+		free_node(ef, node);
 	}
 	return rc;
 }
@@ -117,16 +193,169 @@ static int write_entries(struct exfat* ef, struct exfat_node* dir,
 	return -EIO;
 }
 
-static struct exfat_node* allocate_node(void)
+/*
+ * Names of the children of a cached directory are kept in its chunks of
+ * names in UTF-8, one after another and NUL-terminated. Names of removed
+ * children are just accounted: the chunks are compacted when there is
+ * more garbage than live names.
+ */
+#define NAMES_CHUNK_MIN 512			/* bytes */
+#define NAMES_CHUNK_MAX 65536		/* bytes */
+#define NAMES_GARBAGE_MIN 65536		/* bytes */
+
+struct exfat_name_chunk
+{
+	struct exfat_name_chunk* next;
+	size_t size;			/* capacity in bytes */
+	size_t used;			/* bytes taken */
+	char names[];
+};
+
+static const char* store_bytes(struct exfat_dir_cache* cache,
+		const char* name, size_t size)
 {
-	struct exfat_node* node = malloc(sizeof(struct exfat_node));
-	if (node == NULL)
+	struct exfat_name_chunk* chunk = cache->names;
+	char* stored;
+
+	if (chunk == NULL || chunk->size - chunk->used < size)
 	{
-		exfat_error("failed to allocate node");
-		return NULL;
+		size_t chunk_size = chunk ? MIN(chunk->size * 2, NAMES_CHUNK_MAX) :
+				NAMES_CHUNK_MIN;
+
+		chunk_size = MAX(chunk_size, size);
+		chunk = malloc(sizeof(struct exfat_name_chunk) + chunk_size);
+		if (chunk == NULL)
+		{
+			exfat_error("failed to allocate names chunk");
+			return NULL;
+		}
+		chunk->size = chunk_size;
+		chunk->used = 0;
+		chunk->next = cache->names;
+		cache->names = chunk;
+		cache->names_size += chunk_size;
 	}
-	memset(node, 0, sizeof(struct exfat_node));
-	return node;
+	stored = chunk->names + chunk->used;
+	memcpy(stored, name, size);
+	chunk->used += size;
+	cache->names_used += size;
+	return stored;
+}
+
+static int store_name(struct exfat_dir_cache* cache, const le16_t* name,
+		size_t length, const char** stored)
+{
+	char buffer[EXFAT_UTF8_NAME_BUFFER_MAX];
+	int rc;
+
+	rc = exfat_utf16_to_utf8(buffer, name, sizeof(buffer), length);
+	if (rc != 0)
+		return rc;
+	*stored = store_bytes(cache, buffer, strlen(buffer) + 1);
+	return *stored ? 0 : -ENOMEM;
+}
+
+static void free_names(struct exfat_dir_cache* cache)
+{
+	while (cache->names)
+	{
+		struct exfat_name_chunk* next = cache->names->next;
+		free(cache->names);
+		cache->names = next;
+	}
+	cache->names_size = 0;
+	cache->names_used = 0;
+}
+
+static int set_name(struct exfat_node* dir, struct exfat_node* node,
+		const le16_t* name, size_t length)
+{
+	int rc;
+
+	rc = store_name(dir->cache, name, length, &node->name);
+	if (rc != 0)
+		return rc;
+	node->name_length = length;
+	node->is_name_owned = false;
+	return 0;
+}
+
+/*
+ * Move all names of the directory children into a single chunk.
+ */
+static void compact_names(struct exfat_node* dir)
+{
+	struct exfat_dir_cache* cache = dir->cache;
+	struct exfat_dir_cache compacted;
+	struct exfat_node* node;
+
+	memset(&compacted, 0, sizeof(compacted));
+	compacted.names = malloc(sizeof(struct exfat_name_chunk) +
+			cache->names_used);
+	if (compacted.names == NULL)
+		return; /* not a problem, just try next time */
+	compacted.names->size = cache->names_used;
+	compacted.names->used = 0;
+	compacted.names->next = NULL;
+	compacted.names_size = cache->names_used;
+
+	for (node = dir->cache->child; node; node = node->next)
+		node->name = store_bytes(&compacted, node->name,
+				strlen(node->name) + 1);
+
+	free_names(cache);
+	cache->names = compacted.names;
+	cache->names_size = compacted.names_size;
+	cache->names_used = compacted.names_used;
+}
+
+/*
+ * Account that a name that took size bytes is not used by the directory
+ * anymore.
+ */
+static void release_name(struct exfat_node* dir, size_t size)
+{
+	struct exfat_dir_cache* cache = dir->cache;
+	size_t garbage;
+
+	cache->names_used -= size;
+	garbage = cache->names_size - cache->names_used;
+	if (garbage > cache->names_used && garbage >= NAMES_GARBAGE_MIN)
+		compact_names(dir);
+}
+
+/*
+ * Give the removed node its own copy of the name: the node can outlive
+ * its former parent's cache.
+ */
+static void disown_name(struct exfat_node* dir, struct exfat_node* node)
+{
+	const size_t size = strlen(node->name) + 1;
+	char* name = malloc(size);
+
+	if (name != NULL)
+	{
+		memcpy(name, node->name, size);
+		node->name = name;
+		node->is_name_owned = true;
+	}
+	else
+	{
+		/* the name is needed only for diagnostics, live without it */
+		node->name = "";
+	}
+	release_name(dir, size);
+}
+
+static void free_dir_cache(struct exfat_node* dir)
+{
+	if (dir->cache == NULL)
+		return;
+	exfat_free_index(dir);
+	exfat_free_slots(dir);
+	free_names(dir->cache);
+	free(dir->cache);
+	dir->cache = NULL;
 }
 
 static void init_node_meta1(struct exfat_node* node,
@@ -134,6 +363,10 @@ static void init_node_meta1(struct exfat_node* node,
 {
 	node->attrib = le16_to_cpu(meta1->attrib);
 	node->continuations = meta1->continuations;
+	node->crtime = meta1->crtime;
+	node->crdate = meta1->crdate;
+	node->crtime_cs = meta1->crtime_cs;
+	node->crtime_tzo = meta1->crtime_tzo;
 	node->mtime = exfat_exfat2unix(meta1->mdate, meta1->mtime,
 			meta1->mtime_cs, meta1->mtime_tzo);
 	/* there is no centiseconds field for atime */
@@ -148,18 +381,32 @@ static void init_node_meta2(struct exfat_node* node,
 	node->size = le64_to_cpu(meta2->size);
 	node->start_cluster = le32_to_cpu(meta2->start_cluster);
 	node->fptr_cluster = node->start_cluster;
+	node->name_hash = le16_to_cpu(meta2->name_hash);
 	node->is_contiguous = ((meta2->flags & EXFAT_FLAG_CONTIGUOUS) != 0);
 }
 
-static void init_node_name(struct exfat_node* node,
-		const struct exfat_entry* entries, int n)
+static int init_node_name(struct exfat_node* dir, struct exfat_node* node,
+		const struct exfat_entry* entries, int n, char* name_buffer)
 {
+	le16_t name[EXFAT_NAME_MAX + 1];
+	int rc;
 	int i;
 
+	memset(name, 0, sizeof(name));
 	for (i = 0; i < n; i++)
-		memcpy(node->name + i * EXFAT_ENAME_MAX,
+		memcpy(name + i * EXFAT_ENAME_MAX,
 				((const struct exfat_entry_name*) &entries[i])->name,
 				EXFAT_ENAME_MAX * sizeof(le16_t));
+	if (name_buffer == NULL)
+		return set_name(dir, node, name, exfat_utf16_length(name));
+
+	rc = exfat_utf16_to_utf8(name_buffer, name, EXFAT_UTF8_NAME_BUFFER_MAX,
+			EXFAT_NAME_MAX);
+	if (rc != 0)
+		return rc;
+	node->name = name_buffer;
+	node->name_length = exfat_utf16_length(name);
+	return 0;
 }
 
 static bool check_entries(const struct exfat_entry* entry, int n)
@@ -206,7 +453,7 @@ static bool check_entries(const struct exfat_entry* entry, int n)
 	return true;
 }
 
-static bool check_node(const struct exfat* ef, struct exfat_node* node,
+static bool check_node(struct exfat* ef, struct exfat_node* node,
 		le16_t actual_checksum, const struct exfat_entry_meta1* meta1)
 {
 	int cluster_size = CLUSTER_SIZE(*ef->sb);
@@ -293,9 +540,16 @@ static bool check_node(const struct exfat* ef, struct exfat_node* node,
 	return ret;
 }
 
-static int parse_file_entries(struct exfat* ef, struct exfat_node* node,
-		const struct exfat_entry* entries, int n)
+/*
+ * Parse an entry set into the node. The name is stored in the names of the
+ * directory, unless name_buffer is given: then it is put there.
+ */
+static int parse_file_entries(struct exfat* ef, struct exfat_node* dir,
+		struct exfat_node* node, const struct exfat_entry* entries, int n,
+		char* name_buffer)
 {
+	int rc;
+
 	const struct exfat_entry_meta1* meta1;
 	const struct exfat_entry_meta2* meta2;
 	int mandatory_entries;
@@ -325,7 +579,10 @@ static int parse_file_entries(struct exfat* ef, struct exfat_node* node,
 
 	init_node_meta1(node, meta1);
 	init_node_meta2(node, meta2);
-	init_node_name(node, entries + 2, mandatory_entries - 2);
+	rc = init_node_name(dir, node, entries + 2, mandatory_entries - 2,
+			name_buffer);
+	if (rc != 0)
+		return rc;
 
 	if (!check_node(ef, node, exfat_calc_checksum(entries, n), meta1))
 		return -EIO;
@@ -333,26 +590,164 @@ static int parse_file_entries(struct exfat* ef, struct exfat_node* node,
 	return 0;
 }
 
-static int parse_file_entry(struct exfat* ef, struct exfat_node* parent,
+/*
+ * Directory reader. Directory contents are read in chunks of up to
+ * DIR_READ_SIZE bytes, physically adjacent clusters with a single read,
+ * and entries are parsed right in the buffer.
+ */
+#define DIR_READ_SIZE (64 * 1024)
+
+struct exfat_dir_reader
+{
+	struct exfat_node* dir;
+	char* buffer;
+	size_t size;		/* buffer capacity */
+	off_t start;		/* directory offset of the buffer */
+	size_t length;		/* valid bytes in the buffer */
+};
+
+static int init_dir_reader(const struct exfat* ef,
+		struct exfat_dir_reader* reader, struct exfat_node* dir)
+{
+	if (!(dir->attrib & EXFAT_ATTRIB_DIR))
+		exfat_bug("attempted to read entries from a file");
+
+	reader->dir = dir;
+	/* an entry set must fit in the buffer at any sector offset */
+	reader->size = MAX(DIR_READ_SIZE, SECTOR_SIZE(*ef->sb) +
+			sizeof(struct exfat_entry[1 + 255]));
+	reader->buffer = malloc(reader->size);
+	if (reader->buffer == NULL)
+	{
+		exfat_error("failed to allocate directory buffer (%zu bytes)",
+				reader->size);
+		return -ENOMEM;
+	}
+	reader->start = 0;
+	reader->length = 0;
+	return 0;
+}
+
+static void free_dir_reader(struct exfat_dir_reader* reader)
+{
+	free(reader->buffer);
+	reader->buffer = NULL;
+}
+
+/*
+ * Fill the reader buffer with directory contents starting at offset.
+ */
+static int fill_dir_reader(struct exfat* ef, struct exfat_dir_reader* reader,
+		off_t offset)
+{
+	struct exfat_node* dir = reader->dir;
+	const uint32_t cluster_size = CLUSTER_SIZE(*ef->sb);
+	const uint64_t length = MIN(reader->size, dir->size - offset);
+	const uint64_t valid = offset < (off_t) dir->valid_size ?
+			MIN(length, dir->valid_size - offset) : 0;
+	cluster_t cluster;
+	off_t run_start = 0;	/* device offset of the pending read */
+	size_t run_length = 0;
+	size_t done = 0;
+
+	reader->start = offset;
+	reader->length = 0;
+
+	cluster = exfat_advance_cluster(ef, dir, offset / cluster_size);
+	while (done < valid)
+	{
+		const uint32_t loffset = (offset + done) % cluster_size;
+		const size_t lsize = MIN(cluster_size - loffset, valid - done);
+
+		if (CLUSTER_INVALID(*ef->sb, cluster))
+		{
+			exfat_error("invalid cluster 0x%x while reading directory",
+					cluster);
+			return -EIO;
+		}
+		if (run_length != 0 &&
+				exfat_c2o(ef, cluster) + loffset !=
+						run_start + (off_t) run_length)
+		{
+			if (exfat_pread(ef->dev, reader->buffer + done - run_length,
+					run_length, run_start) < 0)
+			{
+				exfat_error("failed to read directory at %"PRId64, run_start);
+				return -EIO;
+			}
+			run_length = 0;
+		}
+		if (run_length == 0)
+			run_start = exfat_c2o(ef, cluster) + loffset;
+		run_length += lsize;
+		done += lsize;
+		if (done < valid)
+			cluster = exfat_next_cluster(ef, dir, cluster);
+	}
+	if (run_length != 0 && exfat_pread(ef->dev,
+			reader->buffer + done - run_length, run_length, run_start) < 0)
+	{
+		exfat_error("failed to read directory at %"PRId64, run_start);
+		return -EIO;
+	}
+	/* entries beyond valid size read as zeroes (end of directory) */
+	memset(reader->buffer + valid, 0, length - valid);
+	reader->length = length;
+	return 0;
+}
+
+/*
+ * Get n entries at offset from the reader. The returned pointer is valid
+ * until the next call.
+ */
+static int get_entries(struct exfat* ef, struct exfat_dir_reader* reader,
+		const struct exfat_entry** entries, int n, off_t offset)
+{
+	const size_t size = sizeof(struct exfat_entry[n]);
+	int rc;
+
+	if ((uint64_t) offset >= reader->dir->size)
+		return -ENOENT;
+	if ((uint64_t) offset + size > reader->dir->size)
+	{
+		exfat_error("read %"PRIu64" bytes instead of %zu bytes",
+				reader->dir->size - offset, size);
+		return -EIO;
+	}
+	if (offset < reader->start ||
+			offset + (off_t) size > reader->start + (off_t) reader->length)
+	{
+		/* keep reads sector-aligned */
+		rc = fill_dir_reader(ef, reader,
+				offset - offset % SECTOR_SIZE(*ef->sb));
+		if (rc != 0)
+			return rc;
+	}
+	*entries = (const struct exfat_entry*)
+			(reader->buffer + (offset - reader->start));
+	return 0;
+}
+
+static int parse_file_entry(struct exfat* ef, struct exfat_dir_reader* reader,
 		struct exfat_node** node, off_t* offset, int n)
 {
-	struct exfat_entry entries[n];
+	const struct exfat_entry* entries;
 	int rc;
 
-	rc = read_entries(ef, parent, entries, n, *offset);
+	rc = get_entries(ef, reader, &entries, n, *offset);
 	if (rc != 0)
 		return rc;
 
 	/* a new node has zero references */
-	*node = allocate_node();
+	*node = allocate_node(ef);
 	if (*node == NULL)
 		return -ENOMEM;
 	(*node)->entry_offset = *offset;
 
-	rc = parse_file_entries(ef, *node, entries, n);
+	rc = parse_file_entries(ef, reader->dir, *node, entries, n, NULL);
 	if (rc != 0)
 	{
-		free(*node);
+		free_node(ef, *node);
 		return rc;
 	}
 
@@ -381,13 +776,15 @@ static void decompress_upcase(uint16_t* output, const le16_t* source,
 }
 
 /*
- * Read one entry in a directory at offset position and build a new node
- * structure.
+ * Handle entries without nodes up to the next file entry set. Returns 0
+ * with *offset pointing to the set and *n set to the number of entries in
+ * it, or a negative error code.
  */
-static int readdir(struct exfat* ef, struct exfat_node* parent,
-		struct exfat_node** node, off_t* offset)
+static int skip_to_file(struct exfat* ef, struct exfat_dir_reader* reader,
+		off_t* offset, int* n)
 {
 	int rc;
+	const struct exfat_entry* entries;
 	struct exfat_entry entry;
 	const struct exfat_entry_meta1* meta1;
 	const struct exfat_entry_upcase* upcase;
@@ -399,16 +796,21 @@ static int readdir(struct exfat* ef, struct exfat_node* parent,
 
 	for (;;)
 	{
-		rc = read_entries(ef, parent, &entry, 1, *offset);
+		rc = get_entries(ef, reader, &entries, 1, *offset);
 		if (rc != 0)
 			return rc;
+		entry = entries[0];
+		/* entries without nodes (bitmap, upcase table, label) stay used */
+		if ((entry.type & EXFAT_ENTRY_VALID) && entry.type != EXFAT_ENTRY_FILE)
+			exfat_use_slots(reader->dir, *offset / sizeof(struct exfat_entry),
+					1);
 
 		switch (entry.type)
 		{
 		case EXFAT_ENTRY_FILE:
 			meta1 = (const struct exfat_entry_meta1*) &entry;
-			return parse_file_entry(ef, parent, node, offset,
-					1 + meta1->continuations);
+			*n = 1 + meta1->continuations;
+			return 0;
 
 		case EXFAT_ENTRY_UPCASE:
 			if (ef->upcase != NULL)
@@ -480,25 +882,9 @@ static int readdir(struct exfat* ef, struct exfat_node* parent,
 						DIV_ROUND_UP(ef->cmap.size, 8));
 				return -EIO;
 			}
-			/* FIXME bitmap can be rather big, up to 512 MB */
-			ef->cmap.chunk_size = ef->cmap.size;
-			ef->cmap.chunk = malloc(BMAP_SIZE(ef->cmap.chunk_size));
-			if (ef->cmap.chunk == NULL)
-			{
-				exfat_error("failed to allocate clusters bitmap chunk "
-						"(%"PRIu64" bytes)", le64_to_cpu(bitmap->size));
-				return -ENOMEM;
-			}
-
-			if (exfat_pread(ef->dev, ef->cmap.chunk,
-					BMAP_SIZE(ef->cmap.chunk_size),
-					exfat_c2o(ef, ef->cmap.start_cluster)) < 0)
-			{
-				exfat_error("failed to read clusters bitmap "
-						"(%"PRIu64" bytes starting at cluster %#x)",
-						le64_to_cpu(bitmap->size), ef->cmap.start_cluster);
-				return -EIO;
-			}
+			rc = exfat_load_cmap(ef);
+			if (rc != 0)
+				return rc;
 			break;
 
 		case EXFAT_ENTRY_LABEL:
@@ -521,7 +907,8 @@ static int readdir(struct exfat* ef, struct exfat_node* parent,
 				break; /* deleted entry, ignore it */
 
 			exfat_error("unknown entry type %#hhx", entry.type);
-			if (!EXFAT_REPAIR(unknown_entry, ef, parent, &entry, *offset))
+			if (!EXFAT_REPAIR(unknown_entry, ef, reader->dir, &entry,
+					*offset))
 				return -EIO;
 		}
 		*offset += sizeof(entry);
@@ -529,63 +916,52 @@ static int readdir(struct exfat* ef, struct exfat_node* parent,
 	/* we never reach here */
 }
 
-int exfat_cache_directory(struct exfat* ef, struct exfat_node* dir)
+static int readdir(struct exfat* ef, struct exfat_dir_reader* reader,
+		struct exfat_node** node, off_t* offset)
 {
-	off_t offset = 0;
+	int n;
 	int rc;
-	struct exfat_node* node;
-	struct exfat_node* current = NULL;
-
-	if (dir->is_cached)
-		return 0; /* already cached */
-
-	while ((rc = readdir(ef, dir, &node, &offset)) == 0)
-	{
-		node->parent = dir;
-		if (current != NULL)
-		{
-			current->next = node;
-			node->prev = current;
-		}
-		else
-			dir->child = node;
-
-		current = node;
-	}
 
-	if (rc != -ENOENT)
-	{
-		/* rollback */
-		for (current = dir->child; current; current = node)
-		{
-			node = current->next;
-			free(current);
-		}
-		dir->child = NULL;
+	rc = skip_to_file(ef, reader, offset, &n);
+	if (rc != 0)
 		return rc;
-	}
-
-	dir->is_cached = true;
-	return 0;
+	return parse_file_entry(ef, reader, node, offset, n);
 }
 
+/*
+ * Children are kept in the order of their entry offsets.
+ */
 static void tree_attach(struct exfat_node* dir, struct exfat_node* node)
 {
+	struct exfat_node* prev = exfat_find_prev_child(dir, node->entry_offset);
+
 	node->parent = dir;
-	if (dir->child)
-	{
-		dir->child->prev = node;
-		node->next = dir->child;
-	}
-	dir->child = node;
+	node->prev = prev;
+	node->next = prev ? prev->next : dir->cache->child;
+	if (node->next)
+		node->next->prev = node;
+	if (prev)
+		prev->next = node;
+	else
+		dir->cache->child = node;
+	exfat_anchor_child(dir, node);
+	dir->cache->count++;
+	dir->cache->generation++;
+	exfat_index_add(dir, node);
+	exfat_use_slots(dir, node->entry_offset / sizeof(struct exfat_entry),
+			1 + node->continuations);
 }
 
 static void tree_detach(struct exfat_node* node)
 {
+	exfat_index_remove(node->parent, node);
+	exfat_unanchor_child(node->parent, node);
+	node->parent->cache->count--;
+	node->parent->cache->generation++;
 	if (node->prev)
 		node->prev->next = node->next;
 	else /* this is the first node in the list */
-		node->parent->child = node->next;
+		node->parent->cache->child = node->next;
 	if (node->next)
 		node->next->prev = node->prev;
 	node->parent = NULL;
@@ -593,63 +969,526 @@ static void tree_detach(struct exfat_node* node)
 	node->next = NULL;
 }
 
-static void reset_cache(struct exfat* ef, struct exfat_node* node)
-{
-	char buffer[EXFAT_UTF8_NAME_BUFFER_MAX];
+/*
+ * Cached directories are kept in LRU order. When their estimated size
+ * exceeds the limit, least recently used directories are dropped from the
+ * cache. Only directories with no cached subdirectories and without
+ * referenced or dirty children are dropped, so nobody can hold a pointer
+ * to a freed node; their parents become candidates in turn.
+ */
 
-	while (node->child)
-	{
-		struct exfat_node* p = node->child;
-		reset_cache(ef, p);
-		tree_detach(p);
-		free(p);
-	}
-	node->is_cached = false;
-	if (node->references != 0)
-	{
-		exfat_get_name(node, buffer);
-		exfat_warn("non-zero reference counter (%d) for '%s'",
-				node->references, buffer);
-	}
-	if (node != ef->root && node->is_dirty)
-	{
-		exfat_get_name(node, buffer);
-		exfat_bug("node '%s' is dirty", buffer);
-	}
-	while (node->references)
-		exfat_put_node(ef, node);
+static size_t dir_cache_size(const struct exfat_node* dir)
+{
+	/* children, their index buckets, names and the slots map (a bit, tree
+	   and anchor bytes: about half a byte per entry) */
+	return sizeof(struct exfat_dir_cache) +
+			dir->cache->count * (sizeof(struct exfat_node) + sizeof(void*)) +
+			dir->cache->names_size +
+			dir->size / sizeof(struct exfat_entry) / 2;
 }
 
-void exfat_reset_cache(struct exfat* ef)
+static void lru_unlink(struct exfat* ef, struct exfat_node* dir)
 {
-	reset_cache(ef, ef->root);
+	if (dir->cache->lru_prev)
+		dir->cache->lru_prev->cache->lru_next = dir->cache->lru_next;
+	else
+		ef->dcache.lru_head = dir->cache->lru_next;
+	if (dir->cache->lru_next)
+		dir->cache->lru_next->cache->lru_prev = dir->cache->lru_prev;
+	else
+		ef->dcache.lru_tail = dir->cache->lru_prev;
+	dir->cache->lru_prev = NULL;
+	dir->cache->lru_next = NULL;
 }
 
-int exfat_flush_node(struct exfat* ef, struct exfat_node* node)
+static void lru_push(struct exfat* ef, struct exfat_node* dir)
 {
-	struct exfat_entry entries[1 + node->continuations];
-	struct exfat_entry_meta1* meta1 = (struct exfat_entry_meta1*) &entries[0];
-	struct exfat_entry_meta2* meta2 = (struct exfat_entry_meta2*) &entries[1];
-	int rc;
-	le16_t edate, etime;
+	dir->cache->lru_next = ef->dcache.lru_head;
+	if (ef->dcache.lru_head)
+		ef->dcache.lru_head->cache->lru_prev = dir;
+	else
+		ef->dcache.lru_tail = dir;
+	ef->dcache.lru_head = dir;
+}
 
-	if (!node->is_dirty)
-		return 0; /* no need to flush */
+/*
+ * Directories where removed entries left holes are compacted later, see
+ * exfat_compact_directories().
+ */
+static void note_hole(struct exfat* ef, struct exfat_node* dir, off_t offset)
+{
+	const uint32_t used = dir->size / sizeof(struct exfat_entry) -
+			exfat_count_tail_slots(dir);
+
+	/* a hole in the tail is not a hole, the directory is just shrunk */
+	if (dir->cache->has_holes || offset / sizeof(struct exfat_entry) >= used)
+		return;
+	dir->cache->has_holes = true;
+	dir->cache->holey_next = ef->dcache.holey;
+	ef->dcache.holey = dir;
+}
 
-	if (ef->ro)
-		exfat_bug("unable to flush node to read-only FS");
+static void forget_holes(struct exfat* ef, struct exfat_node* dir)
+{
+	struct exfat_node** p;
+
+	if (!dir->cache->has_holes)
+		return;
+	for (p = &ef->dcache.holey; *p != dir; p = &(*p)->cache->holey_next);
+	*p = dir->cache->holey_next;
+	dir->cache->holey_next = NULL;
+	dir->cache->has_holes = false;
+}
 
-	if (node->parent == NULL)
-		return 0; /* do not flush unlinked node */
+static void uncache_directory(struct exfat* ef, struct exfat_node* dir)
+{
+	if (dir->is_cached)
+	{
+		lru_unlink(ef, dir);
+		ef->dcache.size -= dir->cache->charged;
+		dir->is_cached = false;
+		/* resolved paths may point to its children */
+		ef->paths.generation++;
+		forget_holes(ef, dir);
+	}
+	free_dir_cache(dir);
+}
 
-	rc = read_entries(ef, node->parent, entries, 1 + node->continuations,
-			node->entry_offset);
+static bool can_evict(const struct exfat_node* dir)
+{
+	const struct exfat_node* node;
+
+	if (dir->references != 0)
+		return false;
+	for (node = dir->cache->child; node; node = node->next)
+		if (node->references != 0 || node->is_dirty || node->is_cached)
+			return false;
+	return true;
+}
+
+static void evict_directory(struct exfat* ef, struct exfat_node* dir)
+{
+	struct exfat_node* node;
+	struct exfat_node* next;
+
+	/* the index, slots and names go away with the cache */
+	for (node = dir->cache->child; node; node = next)
+	{
+		next = node->next;
+		free_node(ef, node);
+	}
+	uncache_directory(ef, dir);
+}
+
+/*
+ * Evict directories starting from the least recently used one until the
+ * cache fits the limit. Directories that cannot be evicted are moved to
+ * the head (they are in use anyway) so that they are not checked again
+ * and again. The directory just used (the head) stops the scan.
+ */
+static void evict_directories(struct exfat* ef, struct exfat_node* keep)
+{
+	struct exfat_node* dir = ef->dcache.lru_tail;
+	struct exfat_node* prev;
+
+	while (dir != keep && ef->dcache.size > ef->dcache.limit)
+	{
+		prev = dir->cache->lru_prev;
+		if (can_evict(dir))
+			evict_directory(ef, dir);
+		else
+		{
+			lru_unlink(ef, dir);
+			lru_push(ef, dir);
+		}
+		dir = prev;
+	}
+}
+
+/*
+ * Mark the directory as the most recently used one and recount its size.
+ */
+static void touch_directory(struct exfat* ef, struct exfat_node* dir)
+{
+	const size_t size = dir_cache_size(dir);
+
+	if (ef->dcache.lru_head != dir)
+	{
+		if (dir->cache->lru_prev != NULL || ef->dcache.lru_tail == dir)
+			lru_unlink(ef, dir);
+		lru_push(ef, dir);
+	}
+	ef->dcache.size += size - dir->cache->charged;
+	dir->cache->charged = size;
+	if (ef->dcache.limit != 0 && ef->dcache.size > ef->dcache.limit)
+		evict_directories(ef, dir);
+}
+
+/*
+ * Subdirectories of a just cached directory are likely to be read next by
+ * a tree walk. Ask for their first clusters in advance, so that the reads
+ * overlap instead of waiting for a seek each. Adjacent clusters are asked
+ * for at once.
+ */
+#define PREFETCH_DIRS 64
+
+static void prefetch_subdirs(struct exfat* ef, const struct exfat_node* dir)
+{
+	const uint32_t cluster_size = CLUSTER_SIZE(*ef->sb);
+	const struct exfat_node* node;
+	off_t start = 0;
+	size_t size = 0;
+	int count = 0;
+
+	for (node = dir->cache->child; node && count < PREFETCH_DIRS;
+			node = node->next)
+	{
+		off_t offset;
+
+		if (!(node->attrib & EXFAT_ATTRIB_DIR) ||
+				CLUSTER_INVALID(*ef->sb, node->start_cluster))
+			continue;
+		offset = exfat_c2o(ef, node->start_cluster);
+		if (size != 0 && offset != start + (off_t) size)
+		{
+			exfat_prefetch(ef->dev, size, start);
+			size = 0;
+		}
+		if (size == 0)
+			start = offset;
+		size += cluster_size;
+		count++;
+	}
+	if (size != 0)
+		exfat_prefetch(ef->dev, size, start);
+}
+
+int exfat_cache_directory(struct exfat* ef, struct exfat_node* dir)
+{
+	off_t offset = 0;
+	int rc;
+	struct exfat_dir_reader reader;
+	struct exfat_node* node;
+	struct exfat_node* current = NULL;
+
+	if (dir->is_cached)
+	{
+		touch_directory(ef, dir);
+		return 0; /* already cached */
+	}
+
+	dir->cache = calloc(1, sizeof(struct exfat_dir_cache));
+	if (dir->cache == NULL)
+	{
+		exfat_error("failed to allocate directory cache");
+		return -ENOMEM;
+	}
+	rc = exfat_resize_slots(dir, dir->size / sizeof(struct exfat_entry));
 	if (rc != 0)
+	{
+		free_dir_cache(dir);
 		return rc;
-	if (!check_entries(entries, 1 + node->continuations))
-		return -EIO;
+	}
+	rc = init_dir_reader(ef, &reader, dir);
+	if (rc != 0)
+	{
+		free_dir_cache(dir);
+		return rc;
+	}
+	while ((rc = readdir(ef, &reader, &node, &offset)) == 0)
+	{
+		exfat_use_slots(dir, node->entry_offset / sizeof(struct exfat_entry),
+				1 + node->continuations);
+		node->parent = dir;
+		dir->cache->count++;
+		if (current != NULL)
+		{
+			current->next = node;
+			node->prev = current;
+		}
+		else
+			dir->cache->child = node;
+		exfat_anchor_child(dir, node);
+
+		current = node;
+	}
+	free_dir_reader(&reader);
+
+	if (rc != -ENOENT)
+	{
+		/* rollback */
+		for (current = dir->cache->child; current; current = node)
+		{
+			node = current->next;
+			free_node(ef, current);
+		}
+		free_dir_cache(dir);
+		return rc;
+	}
+
+	exfat_index_directory(ef, dir);
+	dir->is_cached = true;
+	touch_directory(ef, dir);
+	prefetch_subdirs(ef, dir);
+	return 0;
+}
+
+static void reset_cache(struct exfat* ef, struct exfat_node* node)
+{
+	char buffer[EXFAT_UTF8_NAME_BUFFER_MAX];
+
+	while (node->cache && node->cache->child)
+	{
+		struct exfat_node* p = node->cache->child;
+		reset_cache(ef, p);
+		tree_detach(p);
+		free_node(ef, p);
+	}
+	uncache_directory(ef, node);
+	if (node->references != 0)
+	{
+		exfat_get_name(node, buffer);
+		exfat_warn("non-zero reference counter (%d) for '%s'",
+				node->references, buffer);
+	}
+	if (node != ef->root && node->is_dirty)
+	{
+		exfat_get_name(node, buffer);
+		exfat_bug("node '%s' is dirty", buffer);
+	}
+	while (node->references)
+		exfat_put_node(ef, node);
+}
+
+void exfat_reset_cache(struct exfat* ef)
+{
+	reset_cache(ef, ef->root);
+}
+
+/*
+ * Directory streams list a directory without caching it: entry sets are
+ * parsed on the fly into records with the name and what stat() needs, so
+ * memory use does not depend on the directory size. A node is created
+ * (and the directory cached) only when the caller asks for it. Cached
+ * directories are listed from the cache.
+ */
+int exfat_open_stream(struct exfat* ef, struct exfat_node* dir,
+		struct exfat_dir_stream* stream)
+{
+	int rc;
+
+	stream->dir = exfat_get_node(dir);
+	stream->current = NULL;
+	stream->reader = NULL;
+	stream->offset = 0;
+	stream->eof = false;
+	if (dir->is_cached)
+	{
+		rc = exfat_cache_directory(ef, dir); /* mark it as used */
+		if (rc != 0)
+			exfat_put_node(ef, dir);
+		return rc;
+	}
+
+	stream->reader = malloc(sizeof(struct exfat_dir_reader));
+	if (stream->reader == NULL)
+	{
+		exfat_put_node(ef, dir);
+		exfat_error("failed to allocate directory stream");
+		return -ENOMEM;
+	}
+	rc = init_dir_reader(ef, stream->reader, dir);
+	if (rc != 0)
+	{
+		free(stream->reader);
+		exfat_put_node(ef, dir);
+	}
+	return rc;
+}
 
+static void init_dirent(struct exfat_dirent* dirent,
+		const struct exfat_node* node)
+{
+	dirent->attrib = node->attrib;
+	dirent->size = node->size;
+	dirent->mtime = node->mtime;
+	dirent->atime = node->atime;
+}
+
+static off_t get_end_offset(const struct exfat_node* node)
+{
+	return node->entry_offset +
+			sizeof(struct exfat_entry[1 + node->continuations]);
+}
+
+static int read_cached_stream(struct exfat* ef,
+		struct exfat_dir_stream* stream, struct exfat_dirent* dirent)
+{
+	struct exfat_node* next;
+
+	/* the current node is referenced so that it stays in the list, unless
+	   it was removed or moved; then continue from the offset */
+	if (stream->current != NULL && stream->current->parent == stream->dir &&
+			get_end_offset(stream->current) == stream->offset)
+		next = stream->current->next;
+	else
+	{
+		next = exfat_find_prev_child(stream->dir, stream->offset);
+		next = next ? next->next : stream->dir->cache->child;
+	}
+	if (stream->current != NULL)
+		exfat_put_node(ef, stream->current);
+	stream->current = next;
+	if (next == NULL)
+	{
+		stream->eof = true;
+		return -ENOENT;
+	}
+	exfat_get_node(next);
+	stream->offset = get_end_offset(next);
+	strcpy(dirent->name, next->name);
+	init_dirent(dirent, next);
+	return 0;
+}
+
+/*
+ * Read the next entry. Returns -ENOENT at the end of the directory.
+ */
+int exfat_read_stream(struct exfat* ef, struct exfat_dir_stream* stream,
+		struct exfat_dirent* dirent)
+{
+	const struct exfat_entry* entries;
+	struct exfat_node node;
+	struct exfat_node* cached;
+	int n;
+	int rc;
+
+	if (stream->eof)
+		return -ENOENT;
+	if (stream->reader == NULL)
+		return read_cached_stream(ef, stream, dirent);
+
+	for (;;)
+	{
+		rc = skip_to_file(ef, stream->reader, &stream->offset, &n);
+		if (rc == 0)
+			rc = get_entries(ef, stream->reader, &entries, n, stream->offset);
+		if (rc != 0)
+		{
+			stream->eof = (rc == -ENOENT);
+			return rc;
+		}
+		/* the node here is not kept, so a repaired checksum would never be
+		   written: leave the repair to lookup, which caches the directory */
+		if (le16_to_cpu(exfat_calc_checksum(entries, n)) !=
+				le16_to_cpu(((const struct exfat_entry_meta1*)
+						&entries[0])->checksum))
+		{
+			exfat_error("entry set at %"PRId64" has invalid checksum, "
+					"skipped", (int64_t) stream->offset);
+			stream->offset += sizeof(struct exfat_entry[n]);
+			continue;
+		}
+		memset(&node, 0, sizeof(struct exfat_node));
+		node.entry_offset = stream->offset;
+		rc = parse_file_entries(ef, stream->dir, &node, entries, n,
+				dirent->name);
+		if (rc != 0)
+			return rc;
+		stream->offset += sizeof(struct exfat_entry[n]);
+		init_dirent(dirent, &node);
+
+		/* the directory could have been cached (and changed) meanwhile,
+		   its nodes are newer than the buffered entries */
+		if (!stream->dir->is_cached)
+			return 0;
+		rc = exfat_lookup_name(ef, stream->dir, &cached, dirent->name,
+				strlen(dirent->name));
+		if (rc == 0)
+		{
+			init_dirent(dirent, cached);
+			exfat_put_node(ef, cached);
+		}
+		if (rc != -ENOENT)
+			return rc;
+		/* removed, skip it */
+	}
+}
+
+/*
+ * Continue from the first entry set at or after the offset. An entry set
+ * keeps its offset while it exists, so a listing can be resumed later from
+ * the offset of the stream.
+ */
+int exfat_seek_stream(struct exfat* ef, struct exfat_dir_stream* stream,
+		off_t offset)
+{
+	const struct exfat_entry* entries;
+	int rc;
+
+	if (stream->current != NULL)
+		exfat_put_node(ef, stream->current);
+	stream->current = NULL;
+	stream->offset = offset;
+	stream->eof = false;
+	if (stream->reader == NULL)
+		return 0;
+
+	/* the directory could have changed since the offset was taken: skip
+	   the rest of an entry set that covers it now */
+	while ((rc = get_entries(ef, stream->reader, &entries, 1,
+			stream->offset)) == 0)
+	{
+		if ((entries[0].type & EXFAT_ENTRY_VALID) == 0 ||
+				(entries[0].type & EXFAT_ENTRY_CONTINUED) == 0)
+			return 0;
+		stream->offset += sizeof(struct exfat_entry);
+	}
+	return rc == -ENOENT ? 0 : rc;
+}
+
+void exfat_close_stream(struct exfat* ef, struct exfat_dir_stream* stream)
+{
+	if (stream->current != NULL)
+		exfat_put_node(ef, stream->current);
+	if (stream->reader != NULL)
+	{
+		free_dir_reader(stream->reader);
+		free(stream->reader);
+	}
+	exfat_put_node(ef, stream->dir);
+	stream->dir = NULL;
+	stream->current = NULL;
+	stream->reader = NULL;
+}
+
+/*
+ * Get a referenced node for an entry of the stream. This caches the
+ * directory.
+ */
+int exfat_get_dirent_node(struct exfat* ef, struct exfat_dir_stream* stream,
+		const struct exfat_dirent* dirent, struct exfat_node** node)
+{
+	return exfat_lookup_name(ef, stream->dir, node, dirent->name,
+			strlen(dirent->name));
+}
+
+/*
+ * Fill the file and file info entries from the node. Reserved fields are
+ * left as they are.
+ */
+static void init_meta(const struct exfat_node* node,
+		struct exfat_entry_meta1* meta1, struct exfat_entry_meta2* meta2)
+{
+	le16_t edate, etime;
+
+	meta1->type = EXFAT_ENTRY_FILE;
+	meta1->continuations = node->continuations;
 	meta1->attrib = cpu_to_le16(node->attrib);
+	meta1->crtime = node->crtime;
+	meta1->crdate = node->crdate;
+	meta1->crtime_cs = node->crtime_cs;
+	meta1->crtime_tzo = node->crtime_tzo;
 	exfat_unix2exfat(node->mtime, &edate, &etime,
 			&meta1->mtime_cs, &meta1->mtime_tzo);
 	meta1->mdate = edate;
@@ -658,6 +1497,9 @@ int exfat_flush_node(struct exfat* ef, struct exfat_node* node)
 			NULL, &meta1->atime_tzo);
 	meta1->adate = edate;
 	meta1->atime = etime;
+	meta2->type = EXFAT_ENTRY_FILE_INFO;
+	meta2->name_length = node->name_length;
+	meta2->name_hash = cpu_to_le16(node->name_hash);
 	meta2->valid_size = cpu_to_le64(node->valid_size);
 	meta2->size = cpu_to_le64(node->size);
 	meta2->start_cluster = cpu_to_le32(node->start_cluster);
@@ -665,31 +1507,306 @@ int exfat_flush_node(struct exfat* ef, struct exfat_node* node)
 	/* empty files must not be marked as contiguous */
 	if (node->size != 0 && node->is_contiguous)
 		meta2->flags |= EXFAT_FLAG_CONTIGUOUS;
-	/* name hash remains unchanged, no need to recalculate it */
+}
+
+static void init_name_entries(struct exfat_entry* entries, const le16_t* name,
+		int name_entries)
+{
+	int i;
+
+	for (i = 0; i < name_entries; i++)
+	{
+		struct exfat_entry_name* name_entry;
+
+		name_entry = (struct exfat_entry_name*) &entries[i];
+		name_entry->type = EXFAT_ENTRY_FILE_NAME;
+		name_entry->__unknown = 0;
+		memcpy(name_entry->name, name + i * EXFAT_ENAME_MAX,
+				EXFAT_ENAME_MAX * sizeof(le16_t));
+	}
+}
+
+/*
+ * Get the entry set of the node. The node keeps everything the file, file
+ * info and name entries have, so the set is rebuilt in memory without
+ * reading it. Only sets with extra entries (vendor extensions and such)
+ * and sets whose cached name does not convert back to UTF-16 are read from
+ * the disk.
+ */
+static int load_entries(struct exfat* ef, struct exfat_node* node,
+		struct exfat_entry* entries)
+{
+	const int name_entries = DIV_ROUND_UP(node->name_length, EXFAT_ENAME_MAX);
+	le16_t name[EXFAT_NAME_MAX + 1];
+	int rc;
 
-	meta1->checksum = exfat_calc_checksum(entries, 1 + node->continuations);
+	/* name entries are padded with zeroes */
+	memset(name, 0, sizeof(name));
+	if (node->continuations == 1 + name_entries &&
+			exfat_utf8_to_utf16(name, node->name, EXFAT_NAME_MAX + 1,
+					strlen(node->name)) == 0)
+	{
+		memset(entries, 0, sizeof(struct exfat_entry[2]));
+		init_meta(node, (struct exfat_entry_meta1*) &entries[0],
+				(struct exfat_entry_meta2*) &entries[1]);
+		init_name_entries(&entries[2], name, name_entries);
+		return 0;
+	}
+
+	rc = read_entries(ef, node->parent, entries, 1 + node->continuations,
+			node->entry_offset);
+	if (rc != 0)
+		return rc;
+	if (!check_entries(entries, 1 + node->continuations))
+		return -EIO;
+	return 0;
+}
+
+static int build_entry_set(struct exfat* ef, struct exfat_node* node,
+		struct exfat_entry* entries)
+{
+	int rc;
+
+	rc = load_entries(ef, node, entries);
+	if (rc != 0)
+		return rc;
+	init_meta(node, (struct exfat_entry_meta1*) &entries[0],
+			(struct exfat_entry_meta2*) &entries[1]);
+	((struct exfat_entry_meta1*) &entries[0])->checksum =
+			exfat_calc_checksum(entries, 1 + node->continuations);
+	return 0;
+}
+
+/*
+ * Dirty nodes are listed so that flushing does not need to walk the whole
+ * tree. A node stays listed until it is flushed or freed. If the list
+ * cannot grow, the node is left out and the next flush walks the tree.
+ */
+
+static bool is_listed(const struct exfat* ef, const struct exfat_node* node)
+{
+	return node->dirty_index < ef->dirty.count &&
+			ef->dirty.nodes[node->dirty_index] == node;
+}
+
+void exfat_mark_dirty(struct exfat* ef, struct exfat_node* node)
+{
+	node->is_dirty = true;
+	if (is_listed(ef, node))
+		return;
+	if (ef->dirty.count == ef->dirty.size)
+	{
+		uint32_t size = MAX(ef->dirty.size * 2, 64);
+		struct exfat_node** nodes = realloc(ef->dirty.nodes,
+				size * sizeof(struct exfat_node*));
+		if (nodes == NULL)
+		{
+			ef->dirty.overflow = true;
+			return;
+		}
+		ef->dirty.nodes = nodes;
+		ef->dirty.size = size;
+	}
+	node->dirty_index = ef->dirty.count;
+	ef->dirty.nodes[ef->dirty.count++] = node;
+}
+
+static void unlist_dirty(struct exfat* ef, struct exfat_node* node)
+{
+	struct exfat_node* last;
+
+	if (!is_listed(ef, node))
+		return;
+	last = ef->dirty.nodes[--ef->dirty.count];
+	last->dirty_index = node->dirty_index;
+	ef->dirty.nodes[node->dirty_index] = last;
+}
+
+int exfat_flush_node(struct exfat* ef, struct exfat_node* node)
+{
+	struct exfat_entry entries[1 + node->continuations];
+	int rc;
+
+	if (!node->is_dirty)
+		return 0; /* no need to flush */
+
+	if (ef->ro)
+		exfat_bug("unable to flush node to read-only FS");
+
+	if (node->parent == NULL)
+		return 0; /* do not flush unlinked node */
+
+	rc = build_entry_set(ef, node, entries);
+	if (rc != 0)
+		return rc;
 	rc = write_entries(ef, node->parent, entries, 1 + node->continuations,
 			node->entry_offset);
 	if (rc != 0)
 		return rc;
-
-	node->is_dirty = false;
+
+	node->is_dirty = false;
+	unlist_dirty(ef, node);
+	return exfat_flush(ef);
+}
+
+static int compare_dirty(const void* a, const void* b)
+{
+	const struct exfat_node* x = *(const struct exfat_node* const*) a;
+	const struct exfat_node* y = *(const struct exfat_node* const*) b;
+
+	if (x->parent != y->parent)
+		return (uintptr_t) x->parent < (uintptr_t) y->parent ? -1 : 1;
+	if (x->entry_offset != y->entry_offset)
+		return x->entry_offset < y->entry_offset ? -1 : 1;
+	return 0;
+}
+
+/*
+ * Write entry sets of nodes that start in the same directory cluster with
+ * a single write. Entries between the sets are read first, if any.
+ */
+static int flush_group(struct exfat* ef, struct exfat_node** nodes, int count,
+		struct exfat_entry* buffer)
+{
+	struct exfat_node* dir = nodes[0]->parent;
+	const off_t start = nodes[0]->entry_offset;
+	const off_t end = nodes[count - 1]->entry_offset +
+			sizeof(struct exfat_entry[1 + nodes[count - 1]->continuations]);
+	const int n = (end - start) / sizeof(struct exfat_entry);
+	int covered = 0;
+	int rc;
+	int i;
+
+	for (i = 0; i < count; i++)
+		covered += 1 + nodes[i]->continuations;
+	if (covered != n)
+	{
+		rc = read_entries(ef, dir, buffer, n, start);
+		if (rc != 0)
+			return rc;
+	}
+	for (i = 0; i < count; i++)
+	{
+		rc = build_entry_set(ef, nodes[i], buffer +
+				(nodes[i]->entry_offset - start) / sizeof(struct exfat_entry));
+		if (rc != 0)
+			return rc;
+	}
+	rc = write_entries(ef, dir, buffer, n, start);
+	if (rc != 0)
+		return rc;
+	for (i = 0; i < count; i++)
+	{
+		nodes[i]->is_dirty = false;
+		unlist_dirty(ef, nodes[i]);
+	}
+	return 0;
+}
+
+static int flush_nodes(struct exfat* ef, struct exfat_node* node)
+{
+	struct exfat_node* p;
+
+	for (p = node->cache ? node->cache->child : NULL; p != NULL; p = p->next)
+	{
+		int rc = flush_nodes(ef, p);
+		if (rc != 0)
+			return rc;
+	}
+	return exfat_flush_node(ef, node);
+}
+
+/*
+ * Write entry sets of the nodes sorted by directory and position, one
+ * write per directory cluster. The number of written nodes is returned in
+ * done, they go first.
+ */
+static int write_groups(struct exfat* ef, struct exfat_node** nodes,
+		uint32_t count, uint32_t* done)
+{
+	const uint32_t cluster_size = CLUSTER_SIZE(*ef->sb);
+	struct exfat_entry* buffer;
+	uint32_t i, j;
+	int rc = 0;
+
+	*done = 0;
+	/* a set starting at the end of a cluster can take 256 entries more */
+	buffer = malloc(cluster_size + sizeof(struct exfat_entry[256]));
+	if (buffer == NULL)
+	{
+		exfat_error("failed to allocate entries buffer");
+		return -ENOMEM;
+	}
+	for (i = 0; i < count; i = j)
+	{
+		for (j = i + 1; j < count; j++)
+			if (nodes[j]->parent != nodes[i]->parent ||
+					nodes[j]->entry_offset / cluster_size !=
+					nodes[i]->entry_offset / cluster_size)
+				break;
+		rc = flush_group(ef, nodes + i, j - i, buffer);
+		if (rc != 0)
+			break;
+		*done = j;
+	}
+	free(buffer);
+	return rc;
+}
+
+/*
+ * Flush all dirty nodes. Normally only the listed ones are visited, sorted
+ * by directory and position, so that dirty entry sets that share a
+ * directory cluster are written together. The whole tree is walked only
+ * if the list could not grow.
+ */
+int exfat_flush_nodes(struct exfat* ef)
+{
+	struct exfat_node** nodes;
+	uint32_t count = 0;
+	uint32_t done;
+	uint32_t i;
+	int rc = 0;
+
+	if (ef->dirty.overflow)
+	{
+		rc = flush_nodes(ef, ef->root);
+		if (rc != 0)
+			return rc;
+		ef->dirty.overflow = false;
+	}
+	if (ef->dirty.count == 0)
+		return 0;
+
+	nodes = malloc(ef->dirty.count * sizeof(struct exfat_node*));
+	if (nodes == NULL)
+	{
+		exfat_error("failed to allocate flush buffers");
+		return -ENOMEM;
+	}
+	for (i = 0; i < ef->dirty.count; i++)
+		if (ef->dirty.nodes[i]->parent != NULL) /* unlinked nodes stay */
+			nodes[count++] = ef->dirty.nodes[i];
+	qsort(nodes, count, sizeof(struct exfat_node*), compare_dirty);
+	rc = write_groups(ef, nodes, count, &done);
+	free(nodes);
+	if (rc != 0)
+		return rc;
 	return exfat_flush(ef);
 }
 
-static int erase_entries(struct exfat* ef, struct exfat_node* dir, int n,
-		off_t offset)
+static int erase_entries(struct exfat* ef, struct exfat_node* node)
 {
-	struct exfat_entry entries[n];
+	struct exfat_entry entries[1 + node->continuations];
 	int rc;
 	int i;
 
-	rc = read_entries(ef, dir, entries, n, offset);
+	rc = load_entries(ef, node, entries);
 	if (rc != 0)
 		return rc;
-	for (i = 0; i < n; i++)
+	for (i = 0; i < 1 + node->continuations; i++)
 		entries[i].type &= ~EXFAT_ENTRY_VALID;
-	return write_entries(ef, dir, entries, n, offset);
+	return write_entries(ef, node->parent, entries, 1 + node->continuations,
+			node->entry_offset);
 }
 
 static int erase_node(struct exfat* ef, struct exfat_node* node)
@@ -697,217 +1814,732 @@ static int erase_node(struct exfat* ef, struct exfat_node* node)
 	int rc;
 
 	exfat_get_node(node->parent);
-	rc = erase_entries(ef, node->parent, 1 + node->continuations,
-			node->entry_offset);
+	rc = erase_entries(ef, node);
 	if (rc != 0)
 	{
 		exfat_put_node(ef, node->parent);
 		return rc;
 	}
+	exfat_release_slots(node->parent,
+			node->entry_offset / sizeof(struct exfat_entry),
+			1 + node->continuations);
 	rc = exfat_flush_node(ef, node->parent);
 	exfat_put_node(ef, node->parent);
 	return rc;
 }
 
-static int shrink_directory(struct exfat* ef, struct exfat_node* dir,
-		off_t deleted_offset)
+/*
+ * Cut free entries off the end of the directory. The last used entry is
+ * known from the slots map, children are not walked.
+ */
+static int shrink_directory(struct exfat* ef, struct exfat_node* dir)
 {
-	const struct exfat_node* node;
-	const struct exfat_node* last_node;
-	uint64_t entries = 0;
+	uint32_t used;
 	uint64_t new_size;
+	int rc;
 
 	if (!(dir->attrib & EXFAT_ATTRIB_DIR))
 		exfat_bug("attempted to shrink a file");
 	if (!dir->is_cached)
 		exfat_bug("attempted to shrink uncached directory");
 
-	for (last_node = node = dir->child; node; node = node->next)
+	dir->cache->has_reserve = false;
+	used = dir->size / sizeof(struct exfat_entry) -
+			exfat_count_tail_slots(dir);
+	new_size = ROUND_UP((uint64_t) used * sizeof(struct exfat_entry),
+			CLUSTER_SIZE(*ef->sb));
+	if (new_size == 0) /* directory always has at least 1 cluster */
+		new_size = CLUSTER_SIZE(*ef->sb);
+	if (new_size == dir->size)
+		return 0;
+	rc = exfat_truncate(ef, dir, new_size, true);
+	if (rc != 0)
+		return rc;
+	/* keep the slots map in sync with the directory size */
+	return exfat_resize_slots(dir, dir->size / sizeof(struct exfat_entry));
+}
+
+/*
+ * A directory that runs out of free entries grows by its current size, but
+ * at most by this many bytes, so that filling it with many files takes a
+ * few large contiguous extensions instead of one per cluster. Only what is
+ * needed right now is erased while the file is created: the rest of the
+ * step, the reserve, is made of clusters the worker has already zeroed, so
+ * without the zeroed pool directories grow as needed. The reserve is kept
+ * until unmount, unless removed entries make the free tail larger than
+ * such a step would be.
+ */
+#define DIR_GROWTH_MAX (1024 * 1024)
+
+/*
+ * Free space a grown directory with used bytes in use may keep.
+ */
+static uint64_t reserve_size(const struct exfat* ef,
+		const struct exfat_node* dir, uint64_t used)
+{
+	if (!dir->cache->has_reserve)
+		return 0;
+	return ROUND_UP(MIN(used, DIR_GROWTH_MAX), CLUSTER_SIZE(*ef->sb));
+}
+
+/*
+ * Shrink the directory unless its free tail is just the reserve it has
+ * grown with, so that creating and removing files does not make it grow
+ * and shrink over and over.
+ */
+static int trim_directory(struct exfat* ef, struct exfat_node* dir)
+{
+	const uint64_t tail = (uint64_t) exfat_count_tail_slots(dir) *
+			sizeof(struct exfat_entry);
+
+	if (tail != 0 && tail <= reserve_size(ef, dir, dir->size - tail))
+		return 0;
+	return shrink_directory(ef, dir);
+}
+
+static int delete(struct exfat* ef, struct exfat_node* node)
+{
+	struct exfat_node* parent = node->parent;
+	off_t deleted_offset = node->entry_offset;
+	int rc;
+
+	exfat_get_node(parent);
+	rc = erase_node(ef, node);
+	if (rc != 0)
+	{
+		exfat_put_node(ef, parent);
+		return rc;
+	}
+	tree_detach(node);
+	disown_name(parent, node);
+	note_hole(ef, parent, deleted_offset);
+	rc = trim_directory(ef, parent);
+	node->is_unlinked = true;
+	if (rc != 0)
+	{
+		exfat_flush_node(ef, parent);
+		exfat_put_node(ef, parent);
+		return rc;
+	}
+	exfat_update_mtime(ef, parent);
+	rc = exfat_flush_node(ef, parent);
+	exfat_put_node(ef, parent);
+	return rc;
+}
+
+int exfat_unlink(struct exfat* ef, struct exfat_node* node)
+{
+	if (node->attrib & EXFAT_ATTRIB_DIR)
+		return -EISDIR;
+	return delete(ef, node);
+}
+
+int exfat_rmdir(struct exfat* ef, struct exfat_node* node)
+{
+	int rc;
+
+	if (!(node->attrib & EXFAT_ATTRIB_DIR))
+		return -ENOTDIR;
+	/* check that directory is empty */
+	rc = exfat_cache_directory(ef, node);
+	if (rc != 0)
+		return rc;
+	if (node->cache->child)
+		return -ENOTEMPTY;
+	return delete(ef, node);
+}
+
+/*
+ * Drop a child whose entry set is erased already or goes away with the
+ * directory clusters, together with its subtree. Referenced nodes are
+ * only unlinked: their clusters are freed by exfat_cleanup_node() after
+ * the last exfat_put_node(), as with exfat_unlink(). Clusters are freed in
+ * the bitmap in memory, the caller flushes it.
+ */
+static int drop_child(struct exfat* ef, struct exfat_node* dir,
+		struct exfat_node* node)
+{
+	struct exfat_node* child;
+	int rc = 0;
+	int child_rc;
+
+	/* there is no entry set to write anymore */
+	node->is_dirty = false;
+	unlist_dirty(ef, node);
+	if (node->attrib & EXFAT_ATTRIB_DIR)
+	{
+		/* keep the directory from being evicted */
+		exfat_get_node(node);
+		rc = exfat_cache_directory(ef, node);
+		if (rc == 0)
+			while ((child = node->cache->child) != NULL)
+			{
+				child_rc = drop_child(ef, node, child);
+				if (rc == 0)
+					rc = child_rc;
+			}
+		exfat_put_node(ef, node);
+	}
+	tree_detach(node);
+	node->is_unlinked = true;
+	if (node->references != 0)
+	{
+		disown_name(dir, node);
+		return rc;
+	}
+	release_name(dir, strlen(node->name) + 1);
+	/* if the subtree could not be read, its clusters are lost until fsck */
+	child_rc = exfat_cleanup_node(ef, node);
+	return rc != 0 ? rc : child_rc;
+}
+
+/*
+ * Erase entry sets of the children from first to last, that start in the
+ * same directory cluster, with a single write and drop the children.
+ */
+static int remove_group(struct exfat* ef, struct exfat_node* dir,
+		struct exfat_node* first, struct exfat_node* last,
+		struct exfat_entry* buffer)
+{
+	const off_t start = first->entry_offset;
+	const int n = (get_end_offset(last) - start) / sizeof(struct exfat_entry);
+	struct exfat_node* end = last->next;
+	struct exfat_node* node;
+	struct exfat_node* next;
+	int rc;
+	int drop_rc;
+	int i;
+
+	rc = read_entries(ef, dir, buffer, n, start);
+	if (rc != 0)
+		return rc;
+	for (node = first; node != end; node = node->next)
+	{
+		struct exfat_entry* entries = buffer +
+				(node->entry_offset - start) / sizeof(struct exfat_entry);
+
+		for (i = 0; i < 1 + node->continuations; i++)
+			entries[i].type &= ~EXFAT_ENTRY_VALID;
+	}
+	rc = write_entries(ef, dir, buffer, n, start);
+	if (rc != 0)
+		return rc;
+
+	for (node = first; node != end; node = next)
+	{
+		next = node->next;
+		exfat_release_slots(dir,
+				node->entry_offset / sizeof(struct exfat_entry),
+				1 + node->continuations);
+		drop_rc = drop_child(ef, dir, node);
+		if (rc == 0)
+			rc = drop_rc;
+	}
+	return rc;
+}
+
+/*
+ * Remove everything inside the directory; the directory itself stays, so
+ * "rm -rf" is this followed by exfat_rmdir(). Entry sets of the children
+ * are erased with one write per directory cluster. Entry sets deeper in
+ * the tree are left as they are: nothing refers to them after that and
+ * their clusters are freed. Cluster chains are freed run by run and the
+ * bitmap is written once at the end, so a crash can only leave lost
+ * clusters behind.
+ */
+int exfat_remove_tree(struct exfat* ef, struct exfat_node* dir)
+{
+	const uint32_t cluster_size = CLUSTER_SIZE(*ef->sb);
+	struct exfat_entry* buffer;
+	struct exfat_node* first;
+	struct exfat_node* last;
+	int rc;
+
+	if (!(dir->attrib & EXFAT_ATTRIB_DIR))
+		return -ENOTDIR;
+	exfat_get_node(dir);
+	rc = exfat_cache_directory(ef, dir);
+	if (rc != 0 || dir->cache->child == NULL)
+	{
+		exfat_put_node(ef, dir);
+		return rc;
+	}
+	/* a set starting at the end of a cluster can take 256 entries more */
+	buffer = malloc(cluster_size + sizeof(struct exfat_entry[256]));
+	if (buffer == NULL)
+	{
+		exfat_put_node(ef, dir);
+		exfat_error("failed to allocate entries buffer");
+		return -ENOMEM;
+	}
+
+	while (rc == 0 && (first = dir->cache->child) != NULL)
+	{
+		for (last = first; last->next != NULL &&
+				last->next->entry_offset / cluster_size ==
+				first->entry_offset / cluster_size; last = last->next);
+		rc = remove_group(ef, dir, first, last, buffer);
+	}
+	free(buffer);
+
+	if (rc == 0)
+		rc = shrink_directory(ef, dir);
+	exfat_update_mtime(ef, dir);
+	if (rc == 0)
+		rc = exfat_flush_node(ef, dir);
+	else
+		exfat_flush_node(ef, dir);	/* ignore return code */
+	/* the root directory has no entry set, flush the bitmap anyway */
+	if (rc == 0)
+		rc = exfat_flush(ef);
+	else
+		exfat_flush(ef);	/* ignore return code */
+	exfat_put_node(ef, dir);
+	return rc;
+}
+
+static int check_slot(struct exfat* ef, struct exfat_node* dir, off_t offset,
+		int n)
+{
+	struct exfat_entry entries[n];
+	int rc;
+	int i;
+
+	/* Root directory contains entries, that don't have any nodes associated
+	   with them (clusters bitmap, upper case table, label). They are marked
+	   as used in the slots map, but we need to be careful not to overwrite
+	   them. */
+	if (dir != ef->root)
+		return 0;
+
+	rc = read_entries(ef, dir, entries, n, offset);
+	if (rc != 0)
+		return rc;
+	for (i = 0; i < n; i++)
+		if (entries[i].type & EXFAT_ENTRY_VALID)
+		{
+			exfat_use_slots(dir, offset / sizeof(struct exfat_entry) + i, 1);
+			rc = -EINVAL;
+		}
+	return rc;
+}
+
+static int find_slot(struct exfat* ef, struct exfat_node* dir,
+		off_t* offset, int n)
+{
+	const uint32_t count = dir->size / sizeof(struct exfat_entry);
+	uint32_t first;
+	uint32_t contiguous;
+	uint64_t needed;
+	uint64_t new_size;
+	int rc;
+
+	if (!dir->is_cached)
+		exfat_bug("directory is not cached");
+
+	/* the directory could have been shrunk since the last call */
+	rc = exfat_resize_slots(dir, count);
+	if (rc != 0)
+		return rc;
+
+	while ((first = exfat_find_slots(dir, n)) != count)
+	{
+		*offset = (off_t) first * sizeof(struct exfat_entry);
+		/* suitable slot is found, check that it's not occupied */
+		rc = check_slot(ef, dir, *offset, n);
+		if (rc != -EINVAL)
+			return rc; /* slot is free or an error occurred */
+	}
+
+	/* no suitable slots found, extend the directory */
+	contiguous = exfat_count_tail_slots(dir);
+	*offset = (off_t) (count - contiguous) * sizeof(struct exfat_entry);
+	needed = ROUND_UP(dir->size + sizeof(struct exfat_entry[n - contiguous]),
+			CLUSTER_SIZE(*ef->sb));
+	new_size = MAX(needed, ROUND_UP(dir->size +
+			MIN(dir->size, DIR_GROWTH_MAX), CLUSTER_SIZE(*ef->sb)));
+	rc = exfat_truncate(ef, dir, needed, true);
+	if (rc != 0)
+		return rc;
+	/* the reserve takes only zeroed clusters, so it costs no writes */
+	new_size = MIN(new_size, needed +
+			(uint64_t) exfat_zero_pool_ready(ef) * CLUSTER_SIZE(*ef->sb));
+	if (new_size != needed && exfat_truncate(ef, dir, new_size, true) == 0)
+		dir->cache->has_reserve = true;
+	return exfat_resize_slots(dir, dir->size / sizeof(struct exfat_entry));
+}
+
+/* an entry set being moved to a lower offset */
+struct moved_set
+{
+	struct exfat_node* node;
+	off_t offset;				/* of the old copy */
+	off_t new_offset;
+	struct exfat_entry* entries;	/* the set to write at new_offset */
+};
+
+static int compare_old_offsets(const void* a, const void* b)
+{
+	const struct moved_set* x = a;
+	const struct moved_set* y = b;
+
+	return x->offset < y->offset ? -1 : x->offset > y->offset;
+}
+
+static int compare_new_offsets(const void* a, const void* b)
+{
+	const struct moved_set* x = a;
+	const struct moved_set* y = b;
+
+	return x->new_offset < y->new_offset ? -1 :
+			x->new_offset > y->new_offset;
+}
+
+/*
+ * Find the first free place for n entries below the slot. Returns -ENOENT
+ * if there is none.
+ */
+static int find_lower_slot(struct exfat* ef, struct exfat_node* dir,
+		uint32_t slot, int n, uint32_t* first)
+{
+	int rc;
+
+	for (;;)
+	{
+		*first = exfat_find_slots(dir, n);
+		if (*first >= slot)
+			return -ENOENT;
+		rc = check_slot(ef, dir, (off_t) *first * sizeof(struct exfat_entry),
+				n);
+		if (rc != -EINVAL)
+			return rc; /* slot is free or an error occurred */
+	}
+}
+
+/*
+ * Write new copies of moved entry sets, one write per directory cluster.
+ * The sets are sorted by their new offsets. The number of written sets is
+ * returned in done, they go first.
+ */
+static int write_moved_sets(struct exfat* ef, struct exfat_node* dir,
+		const struct moved_set* moved, uint32_t count,
+		struct exfat_entry* buffer, uint32_t* done)
+{
+	const uint32_t cluster_size = CLUSTER_SIZE(*ef->sb);
+	uint32_t i, j, k;
+	int rc;
+
+	*done = 0;
+	for (i = 0; i < count; i = j)
+	{
+		const off_t start = moved[i].new_offset;
+		off_t end;
+		int n;
+
+		for (j = i + 1; j < count; j++)
+			if (moved[j].new_offset / cluster_size != start / cluster_size)
+				break;
+		end = moved[j - 1].new_offset + sizeof(struct exfat_entry) *
+				(1 + moved[j - 1].node->continuations);
+		n = (end - start) / sizeof(struct exfat_entry);
+		/* keep whatever lies between the holes */
+		rc = read_entries(ef, dir, buffer, n, start);
+		if (rc != 0)
+			return rc;
+		for (k = i; k < j; k++)
+			memcpy(buffer + (moved[k].new_offset - start) /
+					sizeof(struct exfat_entry), moved[k].entries,
+					sizeof(struct exfat_entry) *
+					(1 + moved[k].node->continuations));
+		rc = write_entries(ef, dir, buffer, n, start);
+		if (rc != 0)
+			return rc;
+		/* the new copies have the latest metadata */
+		for (k = i; k < j; k++)
+		{
+			moved[k].node->is_dirty = false;
+			unlist_dirty(ef, moved[k].node);
+		}
+		*done = j;
+	}
+	return 0;
+}
+
+/*
+ * Erase old copies of moved entry sets, one write per directory cluster.
+ * The sets are sorted by their old offsets.
+ */
+static int erase_moved_sets(struct exfat* ef, struct exfat_node* dir,
+		const struct moved_set* moved, uint32_t count,
+		struct exfat_entry* buffer)
+{
+	const uint32_t cluster_size = CLUSTER_SIZE(*ef->sb);
+	uint32_t i, j, k;
+	int rc;
+
+	for (i = 0; i < count; i = j)
+	{
+		const off_t start = moved[i].offset;
+		off_t end;
+		int n;
+
+		for (j = i + 1; j < count; j++)
+			if (moved[j].offset / cluster_size != start / cluster_size)
+				break;
+		end = moved[j - 1].offset + sizeof(struct exfat_entry) *
+				(1 + moved[j - 1].node->continuations);
+		n = (end - start) / sizeof(struct exfat_entry);
+		/* new copies can lie between the old ones, read them too */
+		rc = read_entries(ef, dir, buffer, n, start);
+		if (rc != 0)
+			return rc;
+		for (k = i; k < j; k++)
+		{
+			struct exfat_entry* entries = buffer +
+					(moved[k].offset - start) / sizeof(struct exfat_entry);
+			int e;
+
+			for (e = 0; e < 1 + moved[k].node->continuations; e++)
+				entries[e].type &= ~EXFAT_ENTRY_VALID;
+		}
+		rc = write_entries(ef, dir, buffer, n, start);
+		if (rc != 0)
+			return rc;
+		for (k = i; k < j; k++)
+			exfat_release_slots(dir,
+					moved[k].offset / sizeof(struct exfat_entry),
+					1 + moved[k].node->continuations);
+	}
+	return 0;
+}
+
+/*
+ * Move entry sets that end beyond the target size down into holes. Only
+ * holes that exist before the call are taken. Sets are read from their
+ * old places first, with only the metadata entries rebuilt, so entries
+ * the driver does not know are moved as they are. Then new copies of all
+ * sets are written, grouped by directory cluster, and old copies are
+ * erased the same way. A crash in between leaves both copies of a moved
+ * set, so the file shows up twice and its clusters are shared by the two
+ * sets; nothing repairs this automatically, see exfat_compact_directories().
+ * The number of moved sets is returned in moved_count.
+ */
+static int move_sets(struct exfat* ef, struct exfat_node* dir,
+		uint64_t target, struct moved_set* moved, uint32_t* moved_count)
+{
+	struct exfat_node* node;
+	struct exfat_entry* sets;
+	struct exfat_entry* buffer;
+	size_t entries = 0;
+	uint32_t count = 0;
+	uint32_t done = 0;
+	uint32_t first;
+	uint32_t i;
+	int rc = 0;
+	int erase_rc;
+
+	*moved_count = 0;
+	for (node = dir->cache->child; node; node = node->next)
 	{
-		if (deleted_offset < node->entry_offset)
+		const uint32_t slot = node->entry_offset / sizeof(struct exfat_entry);
+		const int n = 1 + node->continuations;
+
+		if (node->entry_offset + sizeof(struct exfat_entry[n]) <= target)
+			continue;
+		rc = find_lower_slot(ef, dir, slot, n, &first);
+		if (rc == -ENOENT)
 		{
-			/* there are other entries after the removed one, no way to shrink
-			   this directory */
-			return 0;
+			rc = 0;
+			continue;
 		}
-		if (last_node->entry_offset < node->entry_offset)
-			last_node = node;
+		if (rc != 0)
+			break;
+		/* old slots stay used until the old copy is erased */
+		exfat_use_slots(dir, first, n);
+		moved[count].node = node;
+		moved[count].offset = node->entry_offset;
+		moved[count].new_offset = (off_t) first * sizeof(struct exfat_entry);
+		entries += n;
+		count++;
 	}
 
-	if (last_node)
+	sets = count != 0 ? malloc(sizeof(struct exfat_entry) * entries) : NULL;
+	/* a set starting at the end of a cluster can take 256 entries more */
+	buffer = count != 0 ? malloc(CLUSTER_SIZE(*ef->sb) +
+			sizeof(struct exfat_entry[256])) : NULL;
+	if (count != 0 && (sets == NULL || buffer == NULL))
 	{
-		/* offset of the last entry */
-		entries += last_node->entry_offset / sizeof(struct exfat_entry);
-		/* two subentries with meta info */
-		entries += 2;
-		/* subentries with file name */
-		entries += DIV_ROUND_UP(exfat_utf16_length(last_node->name),
-				EXFAT_ENAME_MAX);
+		exfat_error("failed to allocate compaction buffers");
+		rc = -ENOMEM;
 	}
-
-	new_size = DIV_ROUND_UP(entries * sizeof(struct exfat_entry),
-				 CLUSTER_SIZE(*ef->sb)) * CLUSTER_SIZE(*ef->sb);
-	if (new_size == 0) /* directory always has at least 1 cluster */
-		new_size = CLUSTER_SIZE(*ef->sb);
-	if (new_size == dir->size)
-		return 0;
-	return exfat_truncate(ef, dir, new_size, true);
-}
-
-static int delete(struct exfat* ef, struct exfat_node* node)
-{
-	struct exfat_node* parent = node->parent;
-	off_t deleted_offset = node->entry_offset;
-	int rc;
-
-	exfat_get_node(parent);
-	rc = erase_node(ef, node);
-	if (rc != 0)
+	for (i = 0, entries = 0; rc == 0 && i < count; i++)
 	{
-		exfat_put_node(ef, parent);
-		return rc;
+		moved[i].entries = sets + entries;
+		entries += 1 + moved[i].node->continuations;
+		rc = build_entry_set(ef, moved[i].node, moved[i].entries);
 	}
-	tree_detach(node);
-	rc = shrink_directory(ef, parent, deleted_offset);
-	node->is_unlinked = true;
 	if (rc != 0)
 	{
-		exfat_flush_node(ef, parent);
-		exfat_put_node(ef, parent);
+		for (i = 0; i < count; i++)
+			exfat_release_slots(dir,
+					moved[i].new_offset / sizeof(struct exfat_entry),
+					1 + moved[i].node->continuations);
+		free(sets);
+		free(buffer);
 		return rc;
 	}
-	exfat_update_mtime(parent);
-	rc = exfat_flush_node(ef, parent);
-	exfat_put_node(ef, parent);
-	return rc;
-}
-
-int exfat_unlink(struct exfat* ef, struct exfat_node* node)
-{
-	if (node->attrib & EXFAT_ATTRIB_DIR)
-		return -EISDIR;
-	return delete(ef, node);
-}
+	if (count == 0)
+		return 0;
 
-int exfat_rmdir(struct exfat* ef, struct exfat_node* node)
-{
-	int rc;
+	/* put the nodes to their new places */
+	for (i = 0; i < count; i++)
+	{
+		node = moved[i].node;
+		tree_detach(node);
+		node->entry_offset = moved[i].new_offset;
+		tree_attach(dir, node);
+	}
+	qsort(moved, count, sizeof(struct moved_set), compare_new_offsets);
+	rc = write_moved_sets(ef, dir, moved, count, buffer, &done);
+	free(sets);
 
-	if (!(node->attrib & EXFAT_ATTRIB_DIR))
-		return -ENOTDIR;
-	/* check that directory is empty */
-	rc = exfat_cache_directory(ef, node);
-	if (rc != 0)
-		return rc;
-	if (node->child)
-		return -ENOTEMPTY;
-	return delete(ef, node);
+	/* nodes whose new copies were not written go back to the old places */
+	for (i = done; i < count; i++)
+	{
+		node = moved[i].node;
+		exfat_release_slots(dir,
+				node->entry_offset / sizeof(struct exfat_entry),
+				1 + node->continuations);
+		tree_detach(node);
+		node->entry_offset = moved[i].offset;
+		tree_attach(dir, node);
+	}
+	count = done;
+
+	/* old copies of sets that failed to be erased keep their slots */
+	qsort(moved, count, sizeof(struct moved_set), compare_old_offsets);
+	erase_rc = erase_moved_sets(ef, dir, moved, count, buffer);
+	free(buffer);
+	*moved_count = count;
+	return rc != 0 ? rc : erase_rc;
 }
 
-static int check_slot(struct exfat* ef, struct exfat_node* dir, off_t offset,
-		int n)
+/*
+ * Move entry sets down into holes and cut the free tail off. Entries are
+ * moved only if this frees whole clusters: sets beyond the size the
+ * directory would have if packed tightly go to the first holes that fit
+ * them. A set never moves up. A grown directory fills holes within its
+ * reserve with new entries anyway, so they are left alone.
+ */
+static int compact_directory(struct exfat* ef, struct exfat_node* dir)
 {
-	struct exfat_entry entries[n];
-	int rc;
-	int i;
-
-	/* Root directory contains entries, that don't have any nodes associated
-	   with them (clusters bitmap, upper case table, label). We need to be
-	   careful not to overwrite them. */
-	if (dir != ef->root)
-		return 0;
+	const uint32_t cluster_size = CLUSTER_SIZE(*ef->sb);
+	const uint32_t count = dir->size / sizeof(struct exfat_entry);
+	const uint64_t used = (uint64_t) (count - exfat_count_tail_slots(dir)) *
+			sizeof(struct exfat_entry);
+	const uint64_t live = (uint64_t) exfat_count_used_slots(dir) *
+			sizeof(struct exfat_entry);
+	const uint64_t target = MAX(ROUND_UP(live, cluster_size), cluster_size);
+	struct moved_set* moved;
+	uint32_t moved_count;
+	int rc = 0;
 
-	rc = read_entries(ef, dir, entries, n, offset);
-	if (rc != 0)
-		return rc;
-	for (i = 0; i < n; i++)
-		if (entries[i].type & EXFAT_ENTRY_VALID)
-			return -EINVAL;
-	return 0;
+	if (target + reserve_size(ef, dir, live) < ROUND_UP(used, cluster_size) &&
+			dir->cache->count != 0)
+	{
+		moved = malloc(dir->cache->count * sizeof(struct moved_set));
+		if (moved == NULL)
+		{
+			exfat_error("failed to allocate compaction buffers");
+			return -ENOMEM;
+		}
+		/* sets can move into holes left by sets moved on the previous
+		   pass */
+		do
+			rc = move_sets(ef, dir, target, moved, &moved_count);
+		while (rc == 0 && moved_count != 0);
+		free(moved);
+		if (rc != 0)
+			return rc;
+	}
+	return trim_directory(ef, dir);
 }
 
-static int find_slot(struct exfat* ef, struct exfat_node* dir,
-		off_t* offset, int n)
+/*
+ * Compact directories where removed entries left holes, so that scanning
+ * them reads fewer clusters. Entry sets move to other offsets: this must
+ * not be called while any directory is being listed. Holes are collected
+ * by unlink, rmdir and rename; this is called on unmount with the compact
+ * option only, because a crash in the middle leaves duplicated entry sets.
+ */
+int exfat_compact_directories(struct exfat* ef)
 {
-	bitmap_t* dmap;
-	struct exfat_node* p;
-	size_t i;
-	int contiguous = 0;
-
-	if (!dir->is_cached)
-		exfat_bug("directory is not cached");
+	struct exfat_node* dir;
+	int rc = 0;
 
-	/* build a bitmap of valid entries in the directory */
-	dmap = calloc(BMAP_SIZE(dir->size / sizeof(struct exfat_entry)),
-			sizeof(bitmap_t));
-	if (dmap == NULL)
+	while (rc == 0 && (dir = ef->dcache.holey) != NULL)
 	{
-		exfat_error("failed to allocate directory bitmap (%"PRIu64")",
-				dir->size / sizeof(struct exfat_entry));
-		return -ENOMEM;
+		forget_holes(ef, dir);
+		if (dir->is_unlinked)
+			continue;
+		exfat_get_node(dir);
+		rc = compact_directory(ef, dir);
+		if (rc == 0)
+			rc = exfat_flush_node(ef, dir);
+		else
+			exfat_flush_node(ef, dir);	/* ignore return code */
+		exfat_put_node(ef, dir);
 	}
-	for (p = dir->child; p != NULL; p = p->next)
-		for (i = 0; i < 1u + p->continuations; i++)
-			BMAP_SET(dmap, p->entry_offset / sizeof(struct exfat_entry) + i);
+	return rc;
+}
+
+/*
+ * Cut off the reserve of grown directories, see DIR_GROWTH_MAX. Called on
+ * unmount, before exfat_compact_directories().
+ */
+int exfat_trim_directories(struct exfat* ef)
+{
+	struct exfat_node* dir;
+	int rc = 0;
 
-	/* find a slot in the directory entries bitmap */
-	for (i = 0; i < dir->size / sizeof(struct exfat_entry); i++)
+	for (dir = ef->dcache.lru_head; dir != NULL; dir = dir->cache->lru_next)
 	{
-		if (BMAP_GET(dmap, i) == 0)
-		{
-			if (contiguous++ == 0)
-				*offset = (off_t) i * sizeof(struct exfat_entry);
-			if (contiguous == n)
-			{
-				int rc;
-
-				/* suitable slot is found, check that it's not occupied */
-				rc = check_slot(ef, dir, *offset, n);
-				if (rc == -EINVAL)
-				{
-					/* slot at (i-n) is occupied, go back and check (i-n+1) */
-					i -= contiguous - 1;
-					contiguous = 0;
-				}
-				else
-				{
-					/* slot is free or an error occurred */
-					free(dmap);
-					return rc;
-				}
-			}
-		}
+		int trim_rc;
+
+		if (!dir->cache->has_reserve || dir->is_unlinked)
+			continue;
+		exfat_get_node(dir);
+		trim_rc = shrink_directory(ef, dir);
+		/* holes left for the reserve to fill are worth compacting now;
+		   the first free slot is past the used part if there are none */
+		note_hole(ef, dir, (off_t) exfat_find_slots(dir, 1) *
+				sizeof(struct exfat_entry));
+		if (trim_rc == 0)
+			trim_rc = exfat_flush_node(ef, dir);
 		else
-			contiguous = 0;
+			exfat_flush_node(ef, dir);	/* ignore return code */
+		exfat_put_node(ef, dir);
+		if (rc == 0)
+			rc = trim_rc;
 	}
-	free(dmap);
-
-	/* no suitable slots found, extend the directory */
-	if (contiguous == 0)
-		*offset = dir->size;
-	return exfat_truncate(ef, dir,
-			ROUND_UP(dir->size + sizeof(struct exfat_entry[n - contiguous]),
-					CLUSTER_SIZE(*ef->sb)),
-			true);
+	return rc;
 }
 
-static int commit_entry(struct exfat* ef, struct exfat_node* dir,
-		const le16_t* name, off_t offset, uint16_t attrib)
+/*
+ * Fill the file and file info entries of a new file.
+ */
+static void init_new_meta(struct exfat* ef, const le16_t* name,
+		uint16_t attrib, struct exfat_entry_meta1* meta1,
+		struct exfat_entry_meta2* meta2)
 {
-	struct exfat_node* node;
 	const size_t name_length = exfat_utf16_length(name);
-	const int name_entries = DIV_ROUND_UP(name_length, EXFAT_ENAME_MAX);
-	struct exfat_entry entries[2 + name_entries];
-	struct exfat_entry_meta1* meta1 = (struct exfat_entry_meta1*) &entries[0];
-	struct exfat_entry_meta2* meta2 = (struct exfat_entry_meta2*) &entries[1];
-	int i;
-	int rc;
 	le16_t edate, etime;
 
-	memset(entries, 0, sizeof(struct exfat_entry[2]));
+	memset(meta1, 0, sizeof(struct exfat_entry_meta1));
+	memset(meta2, 0, sizeof(struct exfat_entry_meta2));
 
 	meta1->type = EXFAT_ENTRY_FILE;
-	meta1->continuations = 1 + name_entries;
+	meta1->continuations = 1 + DIV_ROUND_UP(name_length, EXFAT_ENAME_MAX);
 	meta1->attrib = cpu_to_le16(attrib);
 	exfat_unix2exfat(time(NULL), &edate, &etime,
 			&meta1->crtime_cs, &meta1->crtime_tzo);
@@ -921,36 +2553,95 @@ static int commit_entry(struct exfat* ef, struct exfat_node* dir,
 	meta2->name_length = name_length;
 	meta2->name_hash = exfat_calc_name_hash(ef, name, name_length);
 	meta2->start_cluster = cpu_to_le32(EXFAT_CLUSTER_FREE);
+}
 
-	for (i = 0; i < name_entries; i++)
-	{
-		struct exfat_entry_name* name_entry;
-
-		name_entry = (struct exfat_entry_name*) &entries[2 + i];
-		name_entry->type = EXFAT_ENTRY_FILE_NAME;
-		name_entry->__unknown = 0;
-		memcpy(name_entry->name, name + i * EXFAT_ENAME_MAX,
-				EXFAT_ENAME_MAX * sizeof(le16_t));
-	}
+/*
+ * Create a node for a new entry set at offset and attach it to the
+ * directory. This takes the slots.
+ */
+static int attach_new_node(struct exfat* ef, struct exfat_node* dir,
+		const le16_t* name, off_t offset,
+		const struct exfat_entry_meta1* meta1,
+		const struct exfat_entry_meta2* meta2, struct exfat_node** node)
+{
+	int rc;
 
-	meta1->checksum = exfat_calc_checksum(entries, 2 + name_entries);
-	rc = write_entries(ef, dir, entries, 2 + name_entries, offset);
+	*node = allocate_node(ef);
+	if (*node == NULL)
+		return -ENOMEM;
+	rc = set_name(dir, *node, name, exfat_utf16_length(name));
 	if (rc != 0)
+	{
+		free_node(ef, *node);
 		return rc;
+	}
+	(*node)->entry_offset = offset;
+	init_node_meta1(*node, meta1);
+	init_node_meta2(*node, meta2);
 
-	node = allocate_node();
-	if (node == NULL)
-		return -ENOMEM;
-	node->entry_offset = offset;
-	memcpy(node->name, name, name_length * sizeof(le16_t));
-	init_node_meta1(node, meta1);
-	init_node_meta2(node, meta2);
-
-	tree_attach(dir, node);
+	tree_attach(dir, *node);
 	return 0;
 }
 
-static int create(struct exfat* ef, const char* path, uint16_t attrib)
+/*
+ * Drop a new node whose entry set was not written. The caller's reference
+ * to the node is put here.
+ */
+static void discard_new_node(struct exfat* ef, struct exfat_node* node)
+{
+	struct exfat_node* dir = node->parent;
+	const size_t name_size = strlen(node->name) + 1;
+
+	exfat_truncate(ef, node, 0, true);	/* ignore return code */
+	/* nothing of the node is on the disk, its changes go with it */
+	node->is_dirty = false;
+	exfat_put_node(ef, node);
+	if (node->references != 0)
+		exfat_bug("new node has %d references", node->references);
+	exfat_release_slots(dir, node->entry_offset / sizeof(struct exfat_entry),
+			1 + node->continuations);
+	tree_detach(node);
+	free_node(ef, node);
+	release_name(dir, name_size);
+}
+
+/*
+ * Write the entry set of a new node. A directory gets its first cluster
+ * before that, so its entry set is written only once. The node is
+ * referenced on success and dropped on failure.
+ */
+static int commit_entry(struct exfat* ef, struct exfat_node* dir,
+		const le16_t* name, off_t offset, uint16_t attrib,
+		struct exfat_node** node)
+{
+	struct exfat_entry_meta1 meta1;
+	struct exfat_entry_meta2 meta2;
+	int rc;
+
+	init_new_meta(ef, name, attrib, &meta1, &meta2);
+	rc = attach_new_node(ef, dir, name, offset, &meta1, &meta2, node);
+	if (rc != 0)
+		return rc;
+	exfat_get_node(*node);
+	/* directories always have at least one cluster */
+	if (attrib & EXFAT_ATTRIB_DIR)
+		rc = exfat_truncate(ef, *node, CLUSTER_SIZE(*ef->sb), true);
+	if (rc == 0)
+	{
+		exfat_mark_dirty(ef, *node);
+		rc = exfat_flush_node(ef, *node);
+	}
+	if (rc != 0)
+		discard_new_node(ef, *node);
+	return rc;
+}
+
+/*
+ * Create a file, or a directory if attrib has EXFAT_ATTRIB_DIR, and get a
+ * referenced node for it without looking the path up again.
+ */
+int exfat_create(struct exfat* ef, const char* path, uint16_t attrib,
+		struct exfat_node** node)
 {
 	struct exfat_node* dir;
 	struct exfat_node* existing;
@@ -975,51 +2666,150 @@ static int create(struct exfat* ef, const char* path, uint16_t attrib)
 		exfat_put_node(ef, dir);
 		return rc;
 	}
-	rc = commit_entry(ef, dir, name, offset, attrib);
+	rc = commit_entry(ef, dir, name, offset, attrib, node);
 	if (rc != 0)
 	{
 		exfat_put_node(ef, dir);
 		return rc;
 	}
-	exfat_update_mtime(dir);
+	exfat_update_mtime(ef, dir);
 	rc = exfat_flush_node(ef, dir);
 	exfat_put_node(ef, dir);
+	if (rc != 0)
+		exfat_put_node(ef, *node);
 	return rc;
 }
 
 int exfat_mknod(struct exfat* ef, const char* path)
 {
-	return create(ef, path, EXFAT_ATTRIB_ARCH);
+	struct exfat_node* node;
+	int rc;
+
+	rc = exfat_create(ef, path, EXFAT_ATTRIB_ARCH, &node);
+	if (rc != 0)
+		return rc;
+	exfat_put_node(ef, node);
+	return 0;
 }
 
 int exfat_mkdir(struct exfat* ef, const char* path)
 {
-	int rc;
 	struct exfat_node* node;
+	int rc;
 
-	rc = create(ef, path, EXFAT_ATTRIB_DIR);
+	rc = exfat_create(ef, path, EXFAT_ATTRIB_DIR, &node);
 	if (rc != 0)
 		return rc;
-	rc = exfat_lookup(ef, &node, path);
-	if (rc != 0)
+	exfat_put_node(ef, node);
+	return 0;
+}
+
+/*
+ * Create many files in the directory. Entry sets are placed as usual but
+ * kept in memory and written at the end, one write per directory cluster;
+ * the directory itself is updated once. Created directories get their
+ * first cluster before that, so their entry sets are written only once
+ * too. Stops at the first name that is invalid or exists: files before it
+ * are created. If writing fails, files that did not get to the disk are
+ * dropped. The number of files created from the start of the array is
+ * returned in created; a write error can leave some files after them
+ * created as well.
+ */
+int exfat_create_batch(struct exfat* ef, struct exfat_node* dir,
+		const struct exfat_new_file* files, size_t count, size_t* created)
+{
+	struct exfat_node** nodes;
+	struct exfat_node** sorted;
+	struct exfat_node* node;
+	struct exfat_entry_meta1 meta1;
+	struct exfat_entry_meta2 meta2;
+	le16_t name[EXFAT_NAME_MAX + 1];
+	uint32_t attached = 0;
+	uint32_t written;
+	off_t offset;
+	size_t i;
+	int rc = 0;
+	int write_rc;
+
+	*created = 0;
+	if (!(dir->attrib & EXFAT_ATTRIB_DIR))
+		return -ENOTDIR;
+	if (count == 0)
 		return 0;
-	/* directories always have at least one cluster */
-	rc = exfat_truncate(ef, node, CLUSTER_SIZE(*ef->sb), true);
-	if (rc != 0)
+	/* nodes in the order of files and in the order of entry offsets */
+	nodes = malloc(2 * count * sizeof(struct exfat_node*));
+	if (nodes == NULL)
 	{
-		delete(ef, node);
-		exfat_put_node(ef, node);
-		return rc;
+		exfat_error("failed to allocate %zu new nodes", count);
+		return -ENOMEM;
 	}
-	rc = exfat_flush_node(ef, node);
-	if (rc != 0)
+	sorted = nodes + count;
+
+	exfat_get_node(dir);
+	for (i = 0; i < count; i++)
 	{
-		delete(ef, node);
-		exfat_put_node(ef, node);
-		return rc;
+		rc = exfat_convert_name(name, files[i].name);
+		if (rc != 0)
+			break;
+		/* this also finds files created earlier in the batch */
+		rc = exfat_lookup_name(ef, dir, &node, files[i].name,
+				strlen(files[i].name));
+		if (rc == 0)
+		{
+			exfat_put_node(ef, node);
+			rc = -EEXIST;
+		}
+		if (rc != -ENOENT)
+			break;
+		rc = find_slot(ef, dir, &offset,
+				2 + DIV_ROUND_UP(exfat_utf16_length(name), EXFAT_ENAME_MAX));
+		if (rc != 0)
+			break;
+		init_new_meta(ef, name, files[i].attrib, &meta1, &meta2);
+		rc = attach_new_node(ef, dir, name, offset, &meta1, &meta2, &node);
+		if (rc != 0)
+			break;
+		/* the node is not on the disk yet, keep it in memory */
+		exfat_get_node(node);
+		if (files[i].attrib & EXFAT_ATTRIB_DIR)
+		{
+			/* directories always have at least one cluster */
+			rc = exfat_truncate(ef, node, CLUSTER_SIZE(*ef->sb), true);
+			if (rc != 0)
+			{
+				discard_new_node(ef, node);
+				break;
+			}
+		}
+		nodes[attached++] = node;
 	}
-	exfat_put_node(ef, node);
-	return 0;
+
+	/* holes could be filled in any order */
+	memcpy(sorted, nodes, attached * sizeof(struct exfat_node*));
+	qsort(sorted, attached, sizeof(struct exfat_node*), compare_dirty);
+	write_rc = write_groups(ef, sorted, attached, &written);
+	/* written nodes go first in the offsets order */
+	while (*created < attached && written != 0 &&
+			nodes[*created]->entry_offset <= sorted[written - 1]->entry_offset)
+		++*created;
+	while (attached > written)
+		discard_new_node(ef, sorted[--attached]);
+	for (i = 0; i < written; i++)
+		exfat_put_node(ef, sorted[i]);
+	free(nodes);
+	if (rc == 0)
+		rc = write_rc;
+
+	if (written != 0)
+	{
+		exfat_update_mtime(ef, dir);
+		if (rc == 0)
+			rc = exfat_flush_node(ef, dir);
+		else
+			exfat_flush_node(ef, dir);	/* ignore return code */
+	}
+	exfat_put_node(ef, dir);
+	return rc;
 }
 
 static int rename_entry(struct exfat* ef, struct exfat_node* dir,
@@ -1030,10 +2820,20 @@ static int rename_entry(struct exfat* ef, struct exfat_node* dir,
 	struct exfat_entry entries[2 + name_entries];
 	struct exfat_entry_meta1* meta1 = (struct exfat_entry_meta1*) &entries[0];
 	struct exfat_entry_meta2* meta2 = (struct exfat_entry_meta2*) &entries[1];
+	struct exfat_node* old_dir = node->parent;
+	const off_t old_offset = node->entry_offset;
+	const size_t old_size = strlen(node->name) + 1;
+	/* the new set overwrites the old one */
+	const bool in_place = dir == old_dir && new_offset == old_offset;
+	const char* stored_name;
 	int rc;
-	int i;
 
-	rc = read_entries(ef, node->parent, entries, 2, node->entry_offset);
+	memset(entries, 0, sizeof(struct exfat_entry[2]));
+	init_meta(node, meta1, meta2);
+
+	/* store the new name first: nothing must fail after the entries are
+	   written */
+	rc = store_name(dir->cache, name, name_length, &stored_name);
 	if (rc != 0)
 		return rc;
 
@@ -1041,32 +2841,38 @@ static int rename_entry(struct exfat* ef, struct exfat_node* dir,
 	meta2->name_length = name_length;
 	meta2->name_hash = exfat_calc_name_hash(ef, name, name_length);
 
-	rc = erase_node(ef, node);
+	rc = in_place ? 0 : erase_node(ef, node);
 	if (rc != 0)
-		return rc;
-
-	node->entry_offset = new_offset;
-	node->continuations = 1 + name_entries;
-
-	for (i = 0; i < name_entries; i++)
 	{
-		struct exfat_entry_name* name_entry;
-
-		name_entry = (struct exfat_entry_name*) &entries[2 + i];
-		name_entry->type = EXFAT_ENTRY_FILE_NAME;
-		name_entry->__unknown = 0;
-		memcpy(name_entry->name, name + i * EXFAT_ENAME_MAX,
-				EXFAT_ENAME_MAX * sizeof(le16_t));
+		release_name(dir, strlen(stored_name) + 1);
+		return rc;
 	}
 
+	init_name_entries(&entries[2], name, name_entries);
+
 	meta1->checksum = exfat_calc_checksum(entries, 2 + name_entries);
 	rc = write_entries(ef, dir, entries, 2 + name_entries, new_offset);
 	if (rc != 0)
+	{
+		release_name(dir, strlen(stored_name) + 1);
 		return rc;
+	}
 
-	memcpy(node->name, name, (EXFAT_NAME_MAX + 1) * sizeof(le16_t));
+	/* paths of everything inside a renamed directory change */
+	if (node->attrib & EXFAT_ATTRIB_DIR)
+		ef->paths.generation++;
+	/* detach while the node is still in the bucket of the old name */
 	tree_detach(node);
+	node->entry_offset = new_offset;
+	node->continuations = 1 + name_entries;
+	node->name = stored_name;
+	node->name_length = name_length;
+	node->name_hash = le16_to_cpu(meta2->name_hash);
 	tree_attach(dir, node);
+	if (!in_place)
+		note_hole(ef, old_dir, old_offset);
+	/* the node is attached, compaction of the old directory is safe now */
+	release_name(old_dir, old_size);
 	return 0;
 }
 
@@ -1147,8 +2953,14 @@ int exfat_rename(struct exfat* ef, const char* old_path, const char* new_path)
 			exfat_put_node(ef, existing);
 	}
 
-	rc = find_slot(ef, dir, &offset,
-			2 + DIV_ROUND_UP(exfat_utf16_length(name), EXFAT_ENAME_MAX));
+	/* if the new name takes as many entries as the old set, the set is
+	   rewritten in place with a single write */
+	if (dir == node->parent && node->continuations ==
+			1 + DIV_ROUND_UP(exfat_utf16_length(name), EXFAT_ENAME_MAX))
+		offset = node->entry_offset;
+	else
+		rc = find_slot(ef, dir, &offset,
+				2 + DIV_ROUND_UP(exfat_utf16_length(name), EXFAT_ENAME_MAX));
 	if (rc != 0)
 	{
 		exfat_put_node(ef, dir);
@@ -1169,23 +2981,24 @@ int exfat_rename(struct exfat* ef, const char* old_path, const char* new_path)
 	return rc;
 }
 
-void exfat_utimes(struct exfat_node* node, const struct timespec tv[2])
+void exfat_utimes(struct exfat* ef, struct exfat_node* node,
+		const struct timespec tv[2])
 {
 	node->atime = tv[0].tv_sec;
 	node->mtime = tv[1].tv_sec;
-	node->is_dirty = true;
+	exfat_mark_dirty(ef, node);
 }
 
-void exfat_update_atime(struct exfat_node* node)
+void exfat_update_atime(struct exfat* ef, struct exfat_node* node)
 {
 	node->atime = time(NULL);
-	node->is_dirty = true;
+	exfat_mark_dirty(ef, node);
 }
 
-void exfat_update_mtime(struct exfat_node* node)
+void exfat_update_mtime(struct exfat* ef, struct exfat_node* node)
 {
 	node->mtime = time(NULL);
-	node->is_dirty = true;
+	exfat_mark_dirty(ef, node);
 }
 
 const char* exfat_get_label(struct exfat* ef)
@@ -1237,6 +3050,10 @@ int exfat_set_label(struct exfat* ef, const char* label)
 	rc = write_entries(ef, ef->root, (struct exfat_entry*) &entry, 1, offset);
 	if (rc != 0)
 		return rc;
+	if (entry.type & EXFAT_ENTRY_VALID)
+		exfat_use_slots(ef->root, offset / sizeof(struct exfat_entry), 1);
+	else
+		exfat_release_slots(ef->root, offset / sizeof(struct exfat_entry), 1);
 
 	strcpy(ef->label, label);
 	return 0;
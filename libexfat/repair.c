@@ -77,11 +77,11 @@ bool exfat_fix_invalid_vbr_checksum(const struct exfat* ef, void* sector,
 	return true;
 }
 
-bool exfat_fix_invalid_node_checksum(UNUSED const struct exfat* ef,
+bool exfat_fix_invalid_node_checksum(struct exfat* ef,
 		struct exfat_node* node)
 {
 	/* checksum will be rewritten by exfat_flush_node() */
-	node->is_dirty = true;
+	exfat_mark_dirty(ef, node);
 
 	exfat_errors_fixed++;
 	return true;
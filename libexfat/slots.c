@@ -0,0 +1,399 @@
+/*
+	slots.c (18.10.26)
+	Map of free directory entries.
+
+	Free exFAT implementation.
+	Copyright (C) 2010-2023  Andrew Nayenko
+
+	This program is free software; you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 2 of the License, or
+	(at your option) any later version.
+
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License along
+	with this program; if not, write to the Free Software Foundation, Inc.,
+	51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+#include "exfat.h"
+#include <errno.h>
+#include <string.h>
+
+/*
+ * Each cached directory has a map of its entries (slots): a bitmap of used
+ * slots and a tree built over its words. Every tree node knows the length
+ * of the free run at the beginning and at the end of its range and the
+ * longest free run inside. This answers "the first run of n free slots"
+ * in O(log n) and is updated in O(log n) when slots are used or released.
+ * Slots beyond the directory size are marked as used.
+ *
+ * Children of a cached directory are listed in the order of their entry
+ * offsets. For each word the map also keeps the first child whose entry set
+ * starts there (an anchor), so the place of an offset in that list is found
+ * without walking the whole list.
+ */
+
+#define WORD_BITS 64
+
+struct run
+{
+	uint32_t head;		/* free slots at the beginning */
+	uint32_t tail;		/* free slots at the end */
+	uint32_t longest;	/* longest free run */
+};
+
+struct exfat_slot_map
+{
+	uint32_t count;		/* slots in the directory */
+	uint32_t words;		/* capacity in words, power of 2 */
+	uint64_t* bits;		/* 1 means used */
+	struct run* tree;	/* 1-based heap, leaves start at words */
+	struct exfat_node** anchors;	/* first child starting in each word */
+};
+
+static struct run word_run(uint64_t word)
+{
+	struct run r = {0, 0, 0};
+	uint64_t free_bits = ~word;
+
+	while (r.head < WORD_BITS && (word & ((uint64_t) 1 << r.head)) == 0)
+		r.head++;
+	while (r.tail < WORD_BITS &&
+			(word & ((uint64_t) 1 << (WORD_BITS - 1 - r.tail))) == 0)
+		r.tail++;
+	/* each step shortens every run of ones by one */
+	while (free_bits != 0)
+	{
+		free_bits &= free_bits << 1;
+		r.longest++;
+	}
+	return r;
+}
+
+static struct run merge_runs(struct run left, struct run right,
+		uint32_t half)
+{
+	struct run r;
+
+	r.head = left.head == half ? half + right.head : left.head;
+	r.tail = right.tail == half ? half + left.tail : right.tail;
+	r.longest = MAX(MAX(left.longest, right.longest), left.tail + right.head);
+	return r;
+}
+
+static void update_tree(struct exfat_slot_map* map, uint32_t word)
+{
+	uint32_t i = map->words + word;
+	uint32_t half = WORD_BITS;
+
+	map->tree[i] = word_run(map->bits[word]);
+	for (i /= 2; i > 0; i /= 2, half *= 2)
+		map->tree[i] = merge_runs(map->tree[2 * i], map->tree[2 * i + 1],
+				half);
+}
+
+static void build_tree(struct exfat_slot_map* map)
+{
+	uint32_t i;
+	uint32_t level_start;
+	uint32_t half = WORD_BITS;
+
+	for (i = 0; i < map->words; i++)
+		map->tree[map->words + i] = word_run(map->bits[i]);
+	for (level_start = map->words / 2; level_start > 0; level_start /= 2)
+	{
+		for (i = level_start; i < 2 * level_start; i++)
+			map->tree[i] = merge_runs(map->tree[2 * i], map->tree[2 * i + 1],
+					half);
+		half *= 2;
+	}
+}
+
+static void set_slots(struct exfat_slot_map* map, uint32_t first, uint32_t n,
+		bool used)
+{
+	uint32_t i;
+
+	for (i = first; i < first + n; i++)
+	{
+		const uint64_t mask = (uint64_t) 1 << (i % WORD_BITS);
+
+		if (used)
+			map->bits[i / WORD_BITS] |= mask;
+		else
+			map->bits[i / WORD_BITS] &= ~mask;
+		if (i + 1 == first + n || (i + 1) % WORD_BITS == 0)
+			update_tree(map, i / WORD_BITS);
+	}
+}
+
+/*
+ * Change the number of slots. New slots are free.
+ */
+int exfat_resize_slots(struct exfat_node* dir, uint32_t count)
+{
+	struct exfat_slot_map* map = dir->cache->slots;
+	uint32_t words = 1;
+	uint64_t* bits;
+	struct run* tree;
+	struct exfat_node** anchors;
+	uint32_t old_count;
+
+	if (map == NULL)
+	{
+		map = calloc(1, sizeof(struct exfat_slot_map));
+		if (map == NULL)
+		{
+			exfat_error("failed to allocate directory slots map");
+			return -ENOMEM;
+		}
+		dir->cache->slots = map;
+	}
+	if (count == map->count)
+		return 0;
+
+	while (words * WORD_BITS < count)
+		words *= 2;
+	if (words != map->words)
+	{
+		bits = malloc(words * sizeof(uint64_t));
+		tree = malloc(2 * words * sizeof(struct run));
+		anchors = calloc(words, sizeof(struct exfat_node*));
+		if (bits == NULL || tree == NULL || anchors == NULL)
+		{
+			free(bits);
+			free(tree);
+			free(anchors);
+			exfat_error("failed to allocate directory slots map (%u slots)",
+					count);
+			return -ENOMEM;
+		}
+		memset(bits, 0xff, words * sizeof(uint64_t));
+		if (map->bits != NULL)
+			memcpy(bits, map->bits,
+					MIN(words, map->words) * sizeof(uint64_t));
+		/* children never start past the end of the directory */
+		if (map->anchors != NULL)
+			memcpy(anchors, map->anchors,
+					MIN(words, map->words) * sizeof(struct exfat_node*));
+		free(map->bits);
+		free(map->tree);
+		free(map->anchors);
+		map->bits = bits;
+		map->tree = tree;
+		map->anchors = anchors;
+		map->words = words;
+		old_count = MIN(map->count, count);
+		/* slots past the new end are used, the rest keep their state */
+		for (; old_count < words * WORD_BITS; old_count++)
+			map->bits[old_count / WORD_BITS] |=
+					(uint64_t) 1 << (old_count % WORD_BITS);
+		old_count = MIN(map->count, count);
+		map->count = count;
+		for (; old_count < count; old_count++)
+			map->bits[old_count / WORD_BITS] &=
+					~((uint64_t) 1 << (old_count % WORD_BITS));
+		build_tree(map);
+		return 0;
+	}
+
+	if (count > map->count)
+		set_slots(map, map->count, count - map->count, false);
+	else
+		set_slots(map, count, map->count - count, true);
+	map->count = count;
+	return 0;
+}
+
+void exfat_free_slots(struct exfat_node* dir)
+{
+	if (dir->cache == NULL || dir->cache->slots == NULL)
+		return;
+	free(dir->cache->slots->bits);
+	free(dir->cache->slots->tree);
+	free(dir->cache->slots->anchors);
+	free(dir->cache->slots);
+	dir->cache->slots = NULL;
+}
+
+static void check_range(const struct exfat_slot_map* map, uint32_t first,
+		uint32_t n)
+{
+	if (first > map->count || n > map->count - first)
+		exfat_bug("slots %u+%u are out of directory (%u)", first, n,
+				map->count);
+}
+
+void exfat_use_slots(struct exfat_node* dir, uint32_t first, uint32_t n)
+{
+	if (dir->cache == NULL || dir->cache->slots == NULL)
+		return;
+	check_range(dir->cache->slots, first, n);
+	set_slots(dir->cache->slots, first, n, true);
+}
+
+void exfat_release_slots(struct exfat_node* dir, uint32_t first, uint32_t n)
+{
+	if (dir->cache == NULL || dir->cache->slots == NULL)
+		return;
+	check_range(dir->cache->slots, first, n);
+	set_slots(dir->cache->slots, first, n, false);
+}
+
+/*
+ * Find the first run of n free slots. Returns the number of slots in the
+ * directory if there is none.
+ */
+uint32_t exfat_find_slots(const struct exfat_node* dir, uint32_t n)
+{
+	const struct exfat_slot_map* map = dir->cache->slots;
+	uint32_t i = 1;
+	uint32_t first = 0;			/* the first slot of node i */
+	uint32_t half = map->words * WORD_BITS / 2;
+	uint64_t word;
+	uint32_t run = 0;
+	uint32_t bit;
+
+	if (n == 0 || map->tree[1].longest < n)
+		return map->count;
+
+	/* descend to the leftmost node that has the run inside */
+	while (i < map->words)
+	{
+		const struct run* left = &map->tree[2 * i];
+		const struct run* right = &map->tree[2 * i + 1];
+
+		if (left->longest >= n)
+			i = 2 * i;
+		else if (left->tail + right->head >= n)
+			return first + half - left->tail;
+		else
+		{
+			i = 2 * i + 1;
+			first += half;
+		}
+		half /= 2;
+	}
+
+	word = map->bits[i - map->words];
+	for (bit = 0; bit < WORD_BITS; bit++)
+	{
+		if (word & ((uint64_t) 1 << bit))
+			run = 0;
+		else if (++run == n)
+			return first + bit + 1 - n;
+	}
+	exfat_bug("slots map is inconsistent");
+}
+
+/*
+ * Count free slots at the end of the directory.
+ */
+uint32_t exfat_count_tail_slots(const struct exfat_node* dir)
+{
+	const struct exfat_slot_map* map = dir->cache->slots;
+	uint32_t word = DIV_ROUND_UP(map->count, WORD_BITS);
+	uint32_t bit;
+	uint64_t bits;
+
+	/* whole words are skipped, so a shrinking tail is cheap to track */
+	while (word-- > 0)
+	{
+		bits = map->bits[word];
+		/* slots past the end are marked as used, ignore them */
+		if ((word + 1) * WORD_BITS > map->count)
+			bits &= ((uint64_t) 1 << (map->count % WORD_BITS)) - 1;
+		if (bits == 0)
+			continue;
+		for (bit = WORD_BITS; (bits & ((uint64_t) 1 << (bit - 1))) == 0;
+				bit--);
+		return map->count - (word * WORD_BITS + bit);
+	}
+	return map->count;
+}
+
+/*
+ * Count used slots, including those of entries without nodes.
+ */
+uint32_t exfat_count_used_slots(const struct exfat_node* dir)
+{
+	const struct exfat_slot_map* map = dir->cache->slots;
+	uint32_t used = 0;
+	uint32_t word;
+	uint64_t bits;
+
+	for (word = 0; word * WORD_BITS < map->count; word++)
+	{
+		bits = map->bits[word];
+		/* slots past the end are marked as used, ignore them */
+		if ((word + 1) * WORD_BITS > map->count)
+			bits &= ((uint64_t) 1 << (map->count % WORD_BITS)) - 1;
+		for (; bits != 0; bits &= bits - 1)
+			used++;
+	}
+	return used;
+}
+
+static uint32_t get_word(const struct exfat_node* node)
+{
+	return node->entry_offset / sizeof(struct exfat_entry) / WORD_BITS;
+}
+
+/*
+ * Register a child that is in the list already.
+ */
+void exfat_anchor_child(struct exfat_node* dir, struct exfat_node* node)
+{
+	struct exfat_node** anchor = &dir->cache->slots->anchors[get_word(node)];
+
+	if (*anchor == NULL || (*anchor)->entry_offset > node->entry_offset)
+		*anchor = node;
+}
+
+/*
+ * Forget a child that is still in the list.
+ */
+void exfat_unanchor_child(struct exfat_node* dir, struct exfat_node* node)
+{
+	struct exfat_node** anchor = &dir->cache->slots->anchors[get_word(node)];
+
+	if (*anchor != node)
+		return;
+	if (node->next != NULL && get_word(node->next) == get_word(node))
+		*anchor = node->next;
+	else
+		*anchor = NULL;
+}
+
+/*
+ * Find the last child with the entry offset below the given one. Returns
+ * NULL if there is none.
+ */
+struct exfat_node* exfat_find_prev_child(const struct exfat_node* dir,
+		off_t offset)
+{
+	const struct exfat_slot_map* map = dir->cache->slots;
+	uint64_t word = offset / sizeof(struct exfat_entry) / WORD_BITS;
+	struct exfat_node* node = NULL;
+
+	if (word >= map->words)
+		word = map->words - 1;
+	/* the nearest anchor that is not past the offset */
+	for (;;)
+	{
+		node = map->anchors[word];
+		if (node != NULL && node->entry_offset < offset)
+			break;
+		if (word == 0)
+			return NULL;
+		word--;
+	}
+	while (node->next != NULL && node->next->entry_offset < offset)
+		node = node->next;
+	return node;
+}
@@ -25,32 +25,43 @@
 #include <stdio.h>
 #include <inttypes.h>
 
-void exfat_stat(const struct exfat* ef, const struct exfat_node* node,
-		struct stat* stbuf)
+static void fill_stat(const struct exfat* ef, uint16_t attrib, uint64_t size,
+		time_t mtime, time_t atime, struct stat* stbuf)
 {
 	memset(stbuf, 0, sizeof(struct stat));
-	if (node->attrib & EXFAT_ATTRIB_DIR)
+	if (attrib & EXFAT_ATTRIB_DIR)
 		stbuf->st_mode = S_IFDIR | (0777 & ~ef->dmask);
 	else
 		stbuf->st_mode = S_IFREG | (0777 & ~ef->fmask);
 	stbuf->st_nlink = 1;
 	stbuf->st_uid = ef->uid;
 	stbuf->st_gid = ef->gid;
-	stbuf->st_size = node->size;
-	stbuf->st_blocks = ROUND_UP(node->size, CLUSTER_SIZE(*ef->sb)) / 512;
-	stbuf->st_mtime = node->mtime;
-	stbuf->st_atime = node->atime;
+	stbuf->st_size = size;
+	stbuf->st_blocks = ROUND_UP(size, CLUSTER_SIZE(*ef->sb)) / 512;
+	stbuf->st_mtime = mtime;
+	stbuf->st_atime = atime;
 	/* set ctime to mtime to ensure we don't break programs that rely on ctime
 	   (e.g. rsync) */
-	stbuf->st_ctime = node->mtime;
+	stbuf->st_ctime = mtime;
+}
+
+void exfat_stat(const struct exfat* ef, const struct exfat_node* node,
+		struct stat* stbuf)
+{
+	fill_stat(ef, node->attrib, node->size, node->mtime, node->atime, stbuf);
+}
+
+void exfat_stat_dirent(const struct exfat* ef,
+		const struct exfat_dirent* dirent, struct stat* stbuf)
+{
+	fill_stat(ef, dirent->attrib, dirent->size, dirent->mtime, dirent->atime,
+			stbuf);
 }
 
 void exfat_get_name(const struct exfat_node* node,
 		char buffer[EXFAT_UTF8_NAME_BUFFER_MAX])
 {
-	if (exfat_utf16_to_utf8(buffer, node->name, EXFAT_UTF8_NAME_BUFFER_MAX,
-				EXFAT_NAME_MAX) != 0)
-		exfat_bug("failed to convert name to UTF-8");
+	strcpy(buffer, node->name);
 }
 
 static uint16_t add_checksum_byte(uint16_t sum, uint8_t byte)
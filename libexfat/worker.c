@@ -0,0 +1,600 @@
+/*
+	worker.c (18.10.26)
+	exFAT file system implementation library.
+
+	Free exFAT implementation.
+	Copyright (C) 2010-2023  Andrew Nayenko
+
+	This program is free software; you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 2 of the License, or
+	(at your option) any later version.
+
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License along
+	with this program; if not, write to the Free Software Foundation, Inc.,
+	51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+#include "exfat.h"
+#include <errno.h>
+#include <string.h>
+#include <pthread.h>
+#include <unistd.h>
+
+/*
+ * Background worker. It keeps a small pool of free clusters filled with
+ * zeroes so that directories can grow without waiting for erase. The pool
+ * is a range of clusters, and it holds the free ones of them. Pool
+ * clusters stay free in the clusters bitmap: the allocator skips them
+ * while they are held, and nothing is lost if the volume is not unmounted
+ * cleanly. Which clusters are held changes in the caller's thread only, so
+ * the allocator checks this without the lock; the worker thread just
+ * moves held clusters from one state to another. Everything else in the
+ * library runs in the caller's thread.
+ *
+ * The worker also walks long fragmented chains of removed files and
+ * collects their clusters into runs. The chain stays allocated in the
+ * bitmap until the caller's thread takes the runs and frees them, so
+ * nobody can reuse a cluster (and overwrite its FAT cell) before the cell
+ * is read. A crash in the meantime only leaves lost clusters behind.
+ */
+
+enum zero_state
+{
+	ZERO_UNUSED,
+	ZERO_PENDING,	/* waiting to be zeroed */
+	ZERO_BUSY,		/* being zeroed right now */
+	ZERO_READY,
+	ZERO_FAILED,	/* failed to be zeroed, held until the range moves */
+};
+
+/* FAT cells read at once while walking a chain */
+#define CHAIN_STEP 1024
+/* collected runs waiting to be freed; the worker pauses when there are
+   more */
+#define RUNS_MAX 65536
+
+struct cluster_run
+{
+	cluster_t first;
+	uint32_t count;
+};
+
+struct orphan_chain
+{
+	cluster_t next;			/* the next cluster to visit */
+	uint32_t count;			/* clusters left to visit */
+	struct cluster_run run;	/* the run being collected */
+};
+
+struct exfat_worker
+{
+	pthread_t thread;
+	pthread_mutex_t lock;
+	pthread_cond_t wakeup;
+	pthread_cond_t done;
+	pid_t pid;				/* process the thread runs in */
+	bool running;			/* the thread has not exited */
+	bool stop;
+	cluster_t pool_first;			/* the first cluster of the pool range */
+	uint32_t pool_size;
+	enum zero_state* pool;			/* states of the range clusters */
+	bitmap_t* pool_held;			/* changed in the caller's thread only */
+	struct orphan_chain* chains;	/* the first one is being walked */
+	uint32_t chains_count;
+	uint32_t chains_size;
+	struct cluster_run* runs;		/* ready to be freed */
+	uint32_t runs_count;
+	uint32_t runs_size;
+	/* used by the worker thread only */
+	le32_t cells[CHAIN_STEP];
+	struct cluster_run step_runs[CHAIN_STEP + 1];
+};
+
+/*
+ * Check that the worker thread can do what it is waited for. Threads do
+ * not survive fork(), so a child process has no worker even if it has the
+ * structure. Called with the lock held.
+ */
+static bool is_alive(const struct exfat_worker* worker)
+{
+	return worker->running && worker->pid == getpid();
+}
+
+/*
+ * Find the first range cluster in the state. Returns pool_size if there is
+ * none.
+ */
+static uint32_t find_state(const struct exfat_worker* worker,
+		enum zero_state state)
+{
+	uint32_t i;
+
+	for (i = 0; i < worker->pool_size; i++)
+		if (worker->pool[i] == state)
+			break;
+	return i;
+}
+
+/*
+ * Find the hint cluster if it is ready or, if it is not, the lowest ready
+ * cluster: the range is a run, so the next take can continue it. Returns
+ * pool_size if nothing is ready.
+ */
+static uint32_t find_ready(const struct exfat_worker* worker,
+		cluster_t hint)
+{
+	const uint32_t i = hint - worker->pool_first;
+
+	if (i < worker->pool_size && worker->pool[i] == ZERO_READY)
+		return i;
+	return find_state(worker, ZERO_READY);
+}
+
+static bool read_cells(const struct exfat* ef, struct exfat_worker* worker,
+		cluster_t first, uint32_t count)
+{
+	return exfat_pread(ef->dev, worker->cells, count * sizeof(le32_t),
+			((off_t) le32_to_cpu(ef->sb->fat_sector_start) <<
+			ef->sb->sector_bits) + (off_t) first * sizeof(le32_t)) >= 0;
+}
+
+/*
+ * Visit up to CHAIN_STEP clusters of the chain without the lock. Complete
+ * runs go to step_runs, their number is returned. A run is complete only
+ * when the cell of its last cluster has been read.
+ */
+static uint32_t walk_chain(const struct exfat* ef,
+		struct exfat_worker* worker, struct orphan_chain* chain)
+{
+	const cluster_t fat_cells = le32_to_cpu(ef->sb->cluster_count) +
+			EXFAT_FIRST_DATA_CLUSTER;
+	cluster_t cells_first = 0;
+	uint32_t cells_count = 0;
+	uint32_t runs = 0;
+	uint32_t visited;
+
+	for (visited = 0; visited < CHAIN_STEP && chain->count != 0; visited++)
+	{
+		const cluster_t cluster = chain->next;
+
+		if (CLUSTER_INVALID(*ef->sb, cluster))
+		{
+			exfat_error("invalid cluster 0x%x while freeing in background",
+					cluster);
+			chain->count = 0;
+			break;
+		}
+		if (chain->run.count != 0 &&
+				cluster != chain->run.first + chain->run.count)
+		{
+			worker->step_runs[runs++] = chain->run;
+			chain->run.count = 0;
+		}
+		if (chain->run.count++ == 0)
+			chain->run.first = cluster;
+		if (--chain->count == 0)
+			break;
+		if (cluster - cells_first >= cells_count)
+		{
+			cells_first = cluster - cluster % CHAIN_STEP;
+			cells_count = MIN(CHAIN_STEP, fat_cells - cells_first);
+			if (!read_cells(ef, worker, cells_first, cells_count))
+			{
+				/* the rest of the chain is lost until fsck */
+				exfat_error("failed to read FAT while freeing in background");
+				chain->count = 0;
+				break;
+			}
+		}
+		chain->next = le32_to_cpu(worker->cells[cluster - cells_first]);
+	}
+	if (chain->count == 0 && chain->run.count != 0)
+	{
+		worker->step_runs[runs++] = chain->run;
+		chain->run.count = 0;
+	}
+	return runs;
+}
+
+static bool add_runs(struct exfat_worker* worker, uint32_t count)
+{
+	if (worker->runs_count + count > worker->runs_size)
+	{
+		uint32_t size = MAX(worker->runs_size * 2,
+				worker->runs_count + count);
+		struct cluster_run* runs = realloc(worker->runs,
+				size * sizeof(struct cluster_run));
+
+		if (runs == NULL)
+			return false;
+		worker->runs = runs;
+		worker->runs_size = size;
+	}
+	memcpy(worker->runs + worker->runs_count, worker->step_runs,
+			count * sizeof(struct cluster_run));
+	worker->runs_count += count;
+	return true;
+}
+
+/*
+ * Walk a step of the first chain. Called and returns with the lock held.
+ */
+static void step_chain(struct exfat* ef, struct exfat_worker* worker)
+{
+	struct orphan_chain chain = worker->chains[0];
+	uint32_t runs;
+
+	/* the caller can grow (move) the array meanwhile, but only the worker
+	   changes or removes chains */
+	pthread_mutex_unlock(&worker->lock);
+	runs = walk_chain(ef, worker, &chain);
+	pthread_mutex_lock(&worker->lock);
+
+	if (!add_runs(worker, runs))
+	{
+		exfat_error("failed to allocate %u freed runs", runs);
+		chain.count = 0;	/* clusters are lost until fsck */
+	}
+	if (chain.count != 0)
+		worker->chains[0] = chain;
+	else
+		memmove(worker->chains, worker->chains + 1,
+				--worker->chains_count * sizeof(struct orphan_chain));
+	pthread_cond_broadcast(&worker->done);
+}
+
+static void* worker_main(void* arg)
+{
+	struct exfat* ef = arg;
+	struct exfat_worker* worker = ef->worker;
+
+	pthread_mutex_lock(&worker->lock);
+	while (!worker->stop)
+	{
+		const uint32_t i = find_state(worker, ZERO_PENDING);
+		cluster_t cluster;
+		bool ok;
+
+		if (i == worker->pool_size)
+		{
+			/* zeroing goes first: a growing directory may wait for it */
+			if (worker->chains_count != 0 && worker->runs_count < RUNS_MAX)
+				step_chain(ef, worker);
+			else
+				pthread_cond_wait(&worker->wakeup, &worker->lock);
+			continue;
+		}
+		/* the range does not move while a cluster is busy */
+		worker->pool[i] = ZERO_BUSY;
+		cluster = worker->pool_first + i;
+		pthread_mutex_unlock(&worker->lock);
+
+		/* zero_cluster is never modified after mount, sharing it is safe */
+		ok = exfat_pwrite(ef->dev, ef->zero_cluster, CLUSTER_SIZE(*ef->sb),
+				exfat_c2o(ef, cluster)) >= 0;
+
+		pthread_mutex_lock(&worker->lock);
+		worker->pool[i] = ok ? ZERO_READY : ZERO_FAILED;
+		pthread_cond_broadcast(&worker->done);
+	}
+	worker->running = false;
+	pthread_cond_broadcast(&worker->done);
+	pthread_mutex_unlock(&worker->lock);
+	return NULL;
+}
+
+int exfat_start_worker(struct exfat* ef)
+{
+	const uint32_t zero_pool_size = ef->zero_pool_size;
+	struct exfat_worker* worker;
+	int rc;
+
+	if (ef->ro || (zero_pool_size == 0 && !ef->lazy_free))
+		return 0;
+#ifdef USE_UBLIO
+	/* ublio handles are not thread-safe */
+	exfat_warn("background worker is not supported with ublio");
+	return 0;
+#endif
+
+	worker = malloc(sizeof(struct exfat_worker));
+	if (worker == NULL)
+	{
+		exfat_error("failed to allocate worker");
+		return -ENOMEM;
+	}
+	memset(worker, 0, sizeof(struct exfat_worker));
+	worker->pool_first = EXFAT_CLUSTER_END;	/* not placed yet */
+	worker->pool_size = zero_pool_size;
+	worker->pool = calloc(MAX(zero_pool_size, 1), sizeof(enum zero_state));
+	worker->pool_held = calloc(1, BMAP_SIZE(MAX(zero_pool_size, 1)));
+	if (worker->pool == NULL || worker->pool_held == NULL)
+	{
+		free(worker->pool_held);
+		free(worker->pool);
+		free(worker);
+		exfat_error("failed to allocate zeroed clusters pool (%u)",
+				zero_pool_size);
+		return -ENOMEM;
+	}
+	pthread_mutex_init(&worker->lock, NULL);
+	pthread_cond_init(&worker->wakeup, NULL);
+	pthread_cond_init(&worker->done, NULL);
+	worker->pid = getpid();
+	worker->running = true;
+
+	ef->worker = worker;
+	rc = pthread_create(&worker->thread, NULL, worker_main, ef);
+	if (rc != 0)
+	{
+		ef->worker = NULL;
+		pthread_cond_destroy(&worker->done);
+		pthread_cond_destroy(&worker->wakeup);
+		pthread_mutex_destroy(&worker->lock);
+		free(worker->pool_held);
+		free(worker->pool);
+		free(worker);
+		exfat_error("failed to start worker thread: %s", strerror(rc));
+		return -rc;
+	}
+	exfat_refill_zero_pool(ef, EXFAT_CLUSTER_END);
+	return 0;
+}
+
+void exfat_stop_worker(struct exfat* ef)
+{
+	struct exfat_worker* worker = ef->worker;
+
+	if (worker == NULL)
+		return;
+
+	/* the thread of another process cannot be joined, and its waits are
+	   still recorded in the conditions, so they cannot be destroyed */
+	if (worker->pid == getpid())
+	{
+		pthread_mutex_lock(&worker->lock);
+		worker->stop = true;
+		pthread_cond_signal(&worker->wakeup);
+		pthread_mutex_unlock(&worker->lock);
+		pthread_join(worker->thread, NULL);
+		pthread_cond_destroy(&worker->done);
+		pthread_cond_destroy(&worker->wakeup);
+		pthread_mutex_destroy(&worker->lock);
+	}
+
+	/* pool clusters are free in the bitmap, nothing to return; chains
+	   not freed yet are lost until fsck, exfat_unmount() waits for them */
+	ef->worker = NULL;
+	free(worker->pool_held);
+	free(worker->pool);
+	free(worker->chains);
+	free(worker->runs);
+	free(worker);
+}
+
+/*
+ * Check that the pool holds the cluster. The lock is not needed: only the
+ * caller's thread changes this.
+ */
+bool exfat_zero_pool_contains(const struct exfat* ef, cluster_t cluster)
+{
+	const struct exfat_worker* worker = ef->worker;
+	uint32_t i;
+
+	if (worker == NULL)
+		return false;
+	i = cluster - worker->pool_first;
+	return i < worker->pool_size && BMAP_GET(worker->pool_held, i);
+}
+
+/*
+ * Get the first cluster of the pool range, or EXFAT_CLUSTER_END if there
+ * is no pool or the range is not placed yet.
+ */
+cluster_t exfat_zero_pool_first(const struct exfat* ef)
+{
+	const struct exfat_worker* worker = ef->worker;
+
+	if (worker == NULL || worker->pool_size == 0)
+		return EXFAT_CLUSTER_END;
+	return worker->pool_first;
+}
+
+static uint32_t count_states(const struct exfat* ef, enum zero_state state)
+{
+	struct exfat_worker* worker = ef->worker;
+	uint32_t count = 0;
+	uint32_t i;
+
+	if (worker == NULL)
+		return 0;
+
+	pthread_mutex_lock(&worker->lock);
+	for (i = 0; i < worker->pool_size; i++)
+		if (worker->pool[i] == state)
+			count++;
+	pthread_mutex_unlock(&worker->lock);
+	return count;
+}
+
+uint32_t exfat_zero_pool_ready(const struct exfat* ef)
+{
+	return count_states(ef, ZERO_READY);
+}
+
+/*
+ * Count clusters that the pool holds and can still give out zeroed.
+ */
+uint32_t exfat_zero_pool_usable(const struct exfat* ef)
+{
+	const struct exfat_worker* worker = ef->worker;
+
+	if (worker == NULL)
+		return 0;
+	return worker->pool_size - count_states(ef, ZERO_UNUSED) -
+			count_states(ef, ZERO_FAILED);
+}
+
+/*
+ * Let the worker zero a free cluster of the range.
+ */
+void exfat_zero_pool_add(struct exfat* ef, cluster_t cluster)
+{
+	struct exfat_worker* worker = ef->worker;
+	uint32_t i;
+
+	if (worker == NULL)
+		exfat_bug("zeroed clusters pool is disabled");
+	i = cluster - worker->pool_first;
+	if (i >= worker->pool_size)
+		exfat_bug("cluster 0x%x is out of zeroed clusters pool", cluster);
+
+	pthread_mutex_lock(&worker->lock);
+	if (worker->pool[i] != ZERO_UNUSED)
+		exfat_bug("cluster 0x%x is already in zeroed clusters pool",
+				cluster);
+	worker->pool[i] = ZERO_PENDING;
+	BMAP_SET(worker->pool_held, i);
+	pthread_cond_signal(&worker->wakeup);
+	pthread_mutex_unlock(&worker->lock);
+}
+
+/*
+ * Give all clusters of the pool back and move the range to start from the
+ * first cluster. Waits for the cluster being zeroed, if there is one.
+ */
+void exfat_zero_pool_move(struct exfat* ef, cluster_t first)
+{
+	struct exfat_worker* worker = ef->worker;
+
+	if (worker == NULL)
+		exfat_bug("zeroed clusters pool is disabled");
+
+	pthread_mutex_lock(&worker->lock);
+	while (find_state(worker, ZERO_BUSY) != worker->pool_size &&
+			is_alive(worker))
+		pthread_cond_wait(&worker->done, &worker->lock);
+	memset(worker->pool, 0, worker->pool_size * sizeof(enum zero_state));
+	memset(worker->pool_held, 0, BMAP_SIZE(worker->pool_size));
+	worker->pool_first = first;
+	pthread_mutex_unlock(&worker->lock);
+}
+
+/*
+ * Take a zeroed cluster out of the pool, the hint cluster if it is ready.
+ * If any is true, a cluster that is not zeroed yet will do as well: this
+ * is how the pool gives its clusters back when the volume runs out of free
+ * space.
+ */
+cluster_t exfat_zero_pool_take(struct exfat* ef, cluster_t hint, bool any)
+{
+	struct exfat_worker* worker = ef->worker;
+	cluster_t cluster = EXFAT_CLUSTER_END;
+	uint32_t i;
+
+	if (worker == NULL)
+		return EXFAT_CLUSTER_END;
+
+	pthread_mutex_lock(&worker->lock);
+	for (;;)
+	{
+		i = find_ready(worker, hint);
+		if (i == worker->pool_size && any)
+			i = find_state(worker, ZERO_PENDING);
+		if (i == worker->pool_size && any)
+			i = find_state(worker, ZERO_FAILED);
+		if (i != worker->pool_size || !any ||
+				find_state(worker, ZERO_BUSY) == worker->pool_size ||
+				!is_alive(worker))
+			break;
+		pthread_cond_wait(&worker->done, &worker->lock);
+	}
+	if (i != worker->pool_size)
+	{
+		cluster = worker->pool_first + i;
+		worker->pool[i] = ZERO_UNUSED;
+		BMAP_CLR(worker->pool_held, i);
+	}
+	pthread_mutex_unlock(&worker->lock);
+	return cluster;
+}
+
+/*
+ * Let the worker walk the chain of a removed file. Returns false if this
+ * is not possible, then the caller frees the chain itself.
+ */
+bool exfat_orphan_chain(struct exfat* ef, cluster_t first, uint32_t count)
+{
+	struct exfat_worker* worker = ef->worker;
+	struct orphan_chain* chain;
+
+	if (worker == NULL || !ef->lazy_free)
+		return false;
+
+	pthread_mutex_lock(&worker->lock);
+	if (!is_alive(worker))
+	{
+		pthread_mutex_unlock(&worker->lock);
+		return false;
+	}
+	if (worker->chains_count == worker->chains_size)
+	{
+		uint32_t size = MAX(worker->chains_size * 2, 16);
+		struct orphan_chain* chains = realloc(worker->chains,
+				size * sizeof(struct orphan_chain));
+
+		if (chains == NULL)
+		{
+			pthread_mutex_unlock(&worker->lock);
+			return false;
+		}
+		worker->chains = chains;
+		worker->chains_size = size;
+	}
+	chain = worker->chains + worker->chains_count++;
+	chain->next = first;
+	chain->count = count;
+	chain->run.first = first;
+	chain->run.count = 0;
+	pthread_cond_signal(&worker->wakeup);
+	pthread_mutex_unlock(&worker->lock);
+	return true;
+}
+
+/*
+ * Take a run of clusters the worker has collected. If wait is true, wait
+ * for one while chains are being walked. Returns false if there is none.
+ */
+bool exfat_take_orphan_run(struct exfat* ef, bool wait, cluster_t* first,
+		uint32_t* count)
+{
+	struct exfat_worker* worker = ef->worker;
+	bool found = false;
+
+	if (worker == NULL)
+		return false;
+
+	pthread_mutex_lock(&worker->lock);
+	while (worker->runs_count == 0 && wait && worker->chains_count != 0 &&
+			is_alive(worker))
+		pthread_cond_wait(&worker->done, &worker->lock);
+	if (worker->runs_count != 0)
+	{
+		const struct cluster_run* run = &worker->runs[--worker->runs_count];
+
+		*first = run->first;
+		*count = run->count;
+		found = true;
+		/* the worker could have paused on too many runs */
+		if (worker->runs_count == RUNS_MAX - 1)
+			pthread_cond_signal(&worker->wakeup);
+	}
+	pthread_mutex_unlock(&worker->lock);
+	return found;
+}
@@ -0,0 +1,421 @@
+/*
+	main.c (18.10.26)
+	Replays file operations against clusters allocator and reports
+	fragmentation.
+
+	Free exFAT implementation.
+	Copyright (C) 2026  Andrew Nayenko
+
+	This program is free software; you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 2 of the License, or
+	(at your option) any later version.
+
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License along
+	with this program; if not, write to the Free Software Foundation, Inc.,
+	51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+/*
+	Trace is a text file, one operation per line:
+
+		mkdir <path>
+		create <path>
+		append <path> <bytes>
+		truncate <path> <bytes>
+		unlink <path>
+
+	Operations are applied to a scratch exFAT image (create it with
+	mkexfatfs, a sparse file is fine). Only metadata is written: files are
+	grown without writing their data, so replaying is fast and measures
+	the allocator rather than the disk. Mount options given with -o select
+	the allocation policy, e.g. -o alloc_window=64.
+*/
+
+#include <exfat.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#define SIM_PATH_MAX 1024
+
+struct sim_stats
+{
+	uint64_t ops;
+	uint64_t failed;
+	double alloc_seconds;		/* CPU time spent in allocator calls */
+	uint64_t alloc_calls;
+};
+
+struct tree_stats
+{
+	uint64_t files;
+	uint64_t nonempty;
+	uint64_t contiguous;
+	uint64_t extents;
+	uint64_t max_extents;
+	uint64_t directories;
+	uint64_t directory_extents;
+};
+
+static double cpu_seconds(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int resize(struct exfat* ef, const char* path, uint64_t size,
+		bool append, struct sim_stats* stats)
+{
+	struct exfat_node* node;
+	double start;
+	int rc;
+
+	rc = exfat_lookup(ef, &node, path);
+	if (rc != 0)
+		return rc;
+	if (append)
+		size += node->size;
+	start = cpu_seconds();
+	rc = exfat_truncate(ef, node, size, false);
+	stats->alloc_seconds += cpu_seconds() - start;
+	stats->alloc_calls++;
+	exfat_flush_node(ef, node);
+	exfat_put_node(ef, node);
+	return rc;
+}
+
+static int unlink_path(struct exfat* ef, const char* path,
+		struct sim_stats* stats)
+{
+	struct exfat_node* node;
+	double start;
+	int rc;
+
+	rc = exfat_lookup(ef, &node, path);
+	if (rc != 0)
+		return rc;
+	rc = exfat_unlink(ef, node);
+	exfat_put_node(ef, node);
+	if (rc != 0)
+		return rc;
+	start = cpu_seconds();
+	rc = exfat_cleanup_node(ef, node);
+	stats->alloc_seconds += cpu_seconds() - start;
+	stats->alloc_calls++;
+	return rc;
+}
+
+static int replay(struct exfat* ef, const char* op, const char* path,
+		uint64_t size, struct sim_stats* stats)
+{
+	stats->ops++;
+	if (strcmp(op, "mkdir") == 0)
+		return exfat_mkdir(ef, path);
+	if (strcmp(op, "create") == 0)
+		return exfat_mknod(ef, path);
+	if (strcmp(op, "append") == 0)
+		return resize(ef, path, size, true, stats);
+	if (strcmp(op, "truncate") == 0)
+		return resize(ef, path, size, false, stats);
+	if (strcmp(op, "unlink") == 0)
+		return unlink_path(ef, path, stats);
+	exfat_error("unknown operation '%s'", op);
+	return -EINVAL;
+}
+
+static int replay_trace(struct exfat* ef, FILE* trace,
+		struct sim_stats* stats)
+{
+	char line[SIM_PATH_MAX + 64];
+	char op[16];
+	char path[SIM_PATH_MAX];
+	uint64_t size;
+	unsigned line_no = 0;
+
+	while (fgets(line, sizeof(line), trace))
+	{
+		int fields;
+		int rc;
+
+		line_no++;
+		if (line[0] == '#' || line[0] == '\n')
+			continue;
+		size = 0;
+		fields = sscanf(line, "%15s %1023s %"SCNu64, op, path, &size);
+		if (fields < 2)
+		{
+			exfat_error("malformed trace line %u", line_no);
+			return 1;
+		}
+		rc = replay(ef, op, path, size, stats);
+		if (rc == -EINVAL)
+			return 1;
+		if (rc != 0)
+			stats->failed++;
+	}
+	return 0;
+}
+
+static unsigned next_random(unsigned* seed)
+{
+	*seed = *seed * 1103515245 + 12345;
+	return *seed >> 8;
+}
+
+/*
+ * Generate a synthetic workload: a number of files growing at the same
+ * time by random appends, with occasional truncations and removals.
+ */
+static void generate_trace(struct exfat* ef, unsigned count, unsigned files,
+		uint64_t max_append, unsigned seed, bool print,
+		struct sim_stats* stats)
+{
+	char path[SIM_PATH_MAX];
+	bool* exists;
+	unsigned i;
+
+	exists = calloc(files, sizeof(bool));
+	if (exists == NULL)
+	{
+		exfat_error("failed to allocate %u files", files);
+		return;
+	}
+	for (i = 0; i < count; i++)
+	{
+		const unsigned file = next_random(&seed) % files;
+		const unsigned action = next_random(&seed) % 100;
+		const char* op;
+		uint64_t size = 0;
+
+		snprintf(path, sizeof(path), "/f%u", file);
+		if (!exists[file])
+		{
+			op = "create";
+			exists[file] = true;
+		}
+		else if (action < 80)
+		{
+			op = "append";
+			size = 1 + next_random(&seed) % max_append;
+		}
+		else if (action < 90)
+		{
+			op = "truncate";
+			size = next_random(&seed) % max_append;
+		}
+		else
+		{
+			op = "unlink";
+			exists[file] = false;
+		}
+		if (print)
+			printf("%s %s %"PRIu64"\n", op, path, size);
+		if (replay(ef, op, path, size, stats) != 0)
+			stats->failed++;
+	}
+	free(exists);
+}
+
+static uint64_t count_extents(struct exfat* ef, struct exfat_node* node)
+{
+	uint32_t clusters = DIV_ROUND_UP(node->size, CLUSTER_SIZE(*ef->sb));
+	cluster_t cluster = node->start_cluster;
+	uint64_t extents = 0;
+
+	while (clusters--)
+	{
+		cluster_t next;
+
+		if (CLUSTER_INVALID(*ef->sb, cluster))
+			break;
+		next = exfat_next_cluster(ef, node, cluster);
+		if (next != cluster + 1 || clusters == 0)
+			extents++;
+		cluster = next;
+	}
+	return extents;
+}
+
+static void walk_tree(struct exfat* ef, struct exfat_node* dir,
+		struct tree_stats* ts)
+{
+	struct exfat_iterator it;
+	struct exfat_node* node;
+
+	ts->directories++;
+	ts->directory_extents += count_extents(ef, dir);
+	if (exfat_opendir(ef, dir, &it) != 0)
+		return;
+	while ((node = exfat_readdir(&it)))
+	{
+		if (node->attrib & EXFAT_ATTRIB_DIR)
+			walk_tree(ef, node, ts);
+		else
+		{
+			const uint64_t extents = count_extents(ef, node);
+
+			ts->files++;
+			if (extents != 0)
+				ts->nonempty++;
+			if (extents == 1)
+				ts->contiguous++;
+			ts->extents += extents;
+			ts->max_extents = MAX(ts->max_extents, extents);
+		}
+		exfat_put_node(ef, node);
+	}
+	exfat_closedir(ef, &it);
+}
+
+static void print_free_space(const struct exfat* ef)
+{
+	const cluster_t end = le32_to_cpu(ef->sb->cluster_count) +
+			EXFAT_FIRST_DATA_CLUSTER;
+	uint64_t runs = 0;
+	uint64_t largest = 0;
+	uint64_t current = 0;
+	uint64_t free_clusters = 0;
+	cluster_t c;
+
+	for (c = EXFAT_FIRST_DATA_CLUSTER; c < end; c++)
+	{
+		if (!exfat_is_cluster_allocated(ef, c))
+		{
+			if (current++ == 0)
+				runs++;
+			free_clusters++;
+			largest = MAX(largest, current);
+		}
+		else
+			current = 0;
+	}
+	printf("Free clusters             %10"PRIu64"\n", free_clusters);
+	printf("Free extents              %10"PRIu64"\n", runs);
+	printf("Largest free extent       %10"PRIu64"\n", largest);
+	printf("Free space fragmentation  %9.1f%%\n", free_clusters == 0 ? 0 :
+			100.0 * (free_clusters - largest) / free_clusters);
+}
+
+static void print_report(struct exfat* ef, const struct sim_stats* stats)
+{
+	struct tree_stats ts;
+
+	memset(&ts, 0, sizeof(ts));
+	walk_tree(ef, ef->root, &ts);
+
+	printf("Operations                %10"PRIu64"\n", stats->ops);
+	printf("Failed operations         %10"PRIu64"\n", stats->failed);
+	printf("Files                     %10"PRIu64"\n", ts.files);
+	printf("Directories               %10"PRIu64"\n", ts.directories);
+	printf("Extents per file          %10.2f\n", ts.nonempty == 0 ? 0 :
+			(double) ts.extents / ts.nonempty);
+	printf("Max extents per file      %10"PRIu64"\n", ts.max_extents);
+	printf("Contiguous files          %9.1f%%\n", ts.nonempty == 0 ? 0 :
+			100.0 * ts.contiguous / ts.nonempty);
+	printf("Extents per directory     %10.2f\n",
+			(double) ts.directory_extents / ts.directories);
+	print_free_space(ef);
+	printf("Allocator calls           %10"PRIu64"\n", stats->alloc_calls);
+	printf("Allocator CPU time        %10.3f s\n", stats->alloc_seconds);
+	printf("Allocator CPU per call    %10.3f us\n",
+			stats->alloc_calls == 0 ? 0 :
+			stats->alloc_seconds * 1e6 / stats->alloc_calls);
+}
+
+static void usage(const char* prog)
+{
+	fprintf(stderr, "Usage: %s [-o options] [-t trace | -g count [-f files] "
+			"[-a bytes] [-r seed] [-p]] [-V] <device>\n", prog);
+	exit(1);
+}
+
+int main(int argc, char* argv[])
+{
+	int opt;
+	const char* spec;
+	const char* options = "";
+	const char* trace_path = NULL;
+	unsigned count = 0;
+	unsigned files = 64;
+	uint64_t max_append = 1024 * 1024;
+	unsigned seed = 1;
+	bool print = false;
+	struct exfat ef;
+	struct sim_stats stats;
+	int rc = 0;
+
+	while ((opt = getopt(argc, argv, "o:t:g:f:a:r:pV")) != -1)
+	{
+		switch (opt)
+		{
+		case 'o':
+			options = optarg;
+			break;
+		case 't':
+			trace_path = optarg;
+			break;
+		case 'g':
+			count = strtoul(optarg, NULL, 10);
+			break;
+		case 'f':
+			files = strtoul(optarg, NULL, 10);
+			break;
+		case 'a':
+			max_append = strtoull(optarg, NULL, 10);
+			break;
+		case 'r':
+			seed = strtoul(optarg, NULL, 10);
+			break;
+		case 'p':
+			print = true;
+			break;
+		case 'V':
+			printf("exfatsim %s\n", VERSION);
+			puts("Copyright (C) 2026  Andrew Nayenko");
+			return 0;
+		default:
+			usage(argv[0]);
+		}
+	}
+	if (argc - optind != 1 || (trace_path == NULL) == (count == 0) ||
+			files == 0 || max_append == 0)
+		usage(argv[0]);
+	spec = argv[optind];
+
+	if (exfat_mount(&ef, spec, options) != 0)
+		return 1;
+
+	memset(&stats, 0, sizeof(stats));
+	if (trace_path != NULL)
+	{
+		FILE* trace = strcmp(trace_path, "-") ? fopen(trace_path, "r") : stdin;
+
+		if (trace == NULL)
+		{
+			exfat_unmount(&ef);
+			exfat_error("failed to open '%s'", trace_path);
+			return 1;
+		}
+		rc = replay_trace(&ef, trace, &stats);
+		if (trace != stdin)
+			fclose(trace);
+	}
+	else
+		generate_trace(&ef, count, files, max_append, seed, print, &stats);
+
+	if (!print)
+		print_report(&ef, &stats);
+	exfat_unmount(&ef);
+	return rc;
+}